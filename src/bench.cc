@@ -0,0 +1,440 @@
+/*
+  Headless throughput benchmarks for the CPU side of rendering.
+  Results are printed as one JSON object per line:
+  ledit_bench [--font <path>] [--iterations <n>] [--filter <name>]
+*/
+#include "utf8String.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <math.h>
+#include <new>
+#include <string>
+#include <vector>
+#include "la.h"
+#include "glad.h"
+#include "u8String.h"
+#include "highlighting.h"
+#include "languages.h"
+#include "font_atlas.h"
+#include "cursor.h"
+#include "row_builder.h"
+#include "providers.h"
+#include "../third-party/json/json.hpp"
+
+using json = nlohmann::json;
+
+static std::atomic<uint64_t> allocationCount{0};
+static std::atomic<uint64_t> allocationBytes{0};
+
+void *operator new(size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  allocationBytes.fetch_add(size, std::memory_order_relaxed);
+  void *ptr = std::malloc(size ? size : 1);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { std::free(ptr); }
+
+struct Corpus {
+  std::string name;
+  const Language *language;
+  std::vector<Utf8String> lines;
+  size_t bytes = 0;
+};
+struct BenchConfig {
+  std::string fontPath;
+  std::string filter;
+  int iterations = 5;
+};
+
+static void finishCorpus(Corpus &corpus) {
+  corpus.bytes = 0;
+  for (auto &line : corpus.lines)
+    corpus.bytes += line.size() + 1;
+}
+static Corpus syntheticCpp(size_t count) {
+  Corpus corpus{"cpp_synthetic", &LANGUAGES[0]};
+  const std::vector<std::string> templates = {
+      "#include <vector>",
+      "static int compute_%(const std::vector<int> &values, size_t offset) {",
+      "  for (size_t i = offset; i < values.size(); i++) {",
+      "    if ((values[i] & 0xFF) == % && values[i] > 3.5) {",
+      "      return values[(i + %) % values.size()]; // wrap around",
+      "    }",
+      "  }",
+      "  /* multi line",
+      "     comment with ( brackets ] inside */",
+      "  const char *name = \"value % with \\\"escapes\\\" and {braces}\";",
+      "  return -1;",
+      "}",
+  };
+  for (size_t i = 0; i < count; i++) {
+    std::string line = templates[i % templates.size()];
+    auto pos = line.find('%');
+    if (pos != std::string::npos)
+      line.replace(pos, 1, std::to_string(i));
+    corpus.lines.push_back(Utf8String(line));
+  }
+  finishCorpus(corpus);
+  return corpus;
+}
+static Corpus syntheticRust(const Language *rust, size_t count) {
+  Corpus corpus{"rust_synthetic", rust};
+  const std::vector<std::string> templates = {
+      "use std::collections::HashMap;",
+      "pub fn lookup_%(map: &HashMap<String, Vec<u32>>, key: &str) -> "
+      "Option<u32> {",
+      "    let values = map.get(key)?; // early return",
+      "    match values.iter().find(|v| **v > %) {",
+      "        Some(v) => Some(*v * 2),",
+      "        None => { println!(\"missing {} in {:?}\", key, values); None }",
+      "    }",
+      "}",
+      "/* block comment with unmatched ( bracket */",
+      "impl Display for Item% { fn fmt(&self, f: &mut Formatter) -> Result "
+      "{ write!(f, \"{}\", self.0) } }",
+  };
+  for (size_t i = 0; i < count; i++) {
+    std::string line = templates[i % templates.size()];
+    auto pos = line.find('%');
+    if (pos != std::string::npos)
+      line.replace(pos, 1, std::to_string(i));
+    corpus.lines.push_back(Utf8String(line));
+  }
+  finishCorpus(corpus);
+  return corpus;
+}
+static Corpus minifiedJson(size_t entries) {
+  Corpus corpus{"json_minified", nullptr};
+  json root = json::array();
+  for (size_t i = 0; i < entries; i++) {
+    root.push_back({{"id", i},
+                    {"name", "entry " + std::to_string(i)},
+                    {"tags", {"a", "b", "ü", "日本"}},
+                    {"nested", {{"value", i * 3.5}, {"ok", i % 2 == 0}}}});
+  }
+  corpus.lines.push_back(Utf8String(root.dump()));
+  finishCorpus(corpus);
+  return corpus;
+}
+static Corpus longLineLog(size_t count, size_t width) {
+  Corpus corpus{"log_long_lines", nullptr};
+  for (size_t i = 0; i < count; i++) {
+    std::string line = "2024-01-01T00:00:" + std::to_string(i % 60) +
+                       " INFO [worker-" + std::to_string(i % 8) + "] ";
+    while (line.size() < width)
+      line += "request=" + std::to_string(i) +
+              " status=200 path=/api/v1/items?id=" + std::to_string(i * 7) +
+              " ";
+    corpus.lines.push_back(Utf8String(line));
+  }
+  finishCorpus(corpus);
+  return corpus;
+}
+static bool loadSourceFile(Corpus &corpus, const std::string &path) {
+  if (!fs::exists(path))
+    return false;
+  Cursor cursor(path);
+  corpus.lines = cursor.lines;
+  finishCorpus(corpus);
+  return true;
+}
+
+struct Result {
+  double seconds = 0;
+  uint64_t allocations = 0;
+  uint64_t allocatedBytes = 0;
+};
+static Result measure(int iterations, const std::function<void()> &body) {
+  Result result;
+  // loads glyphs and fills caches, so the samples only see steady state
+  body();
+  for (int i = 0; i < iterations; i++) {
+    auto count = allocationCount.load(std::memory_order_relaxed);
+    auto bytes = allocationBytes.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    body();
+    auto end = std::chrono::steady_clock::now();
+    result.seconds += std::chrono::duration<double>(end - start).count();
+    result.allocations += allocationCount.load(std::memory_order_relaxed) - count;
+    result.allocatedBytes +=
+        allocationBytes.load(std::memory_order_relaxed) - bytes;
+  }
+  return result;
+}
+static void report(const Corpus &corpus, const std::string &bench,
+                   int iterations, const Result &result, uint64_t items,
+                   const std::string &unit) {
+  json out;
+  out["corpus"] = corpus.name;
+  out["bench"] = bench;
+  out["lines"] = corpus.lines.size();
+  out["bytes"] = corpus.bytes;
+  out["iterations"] = iterations;
+  out["seconds"] = result.seconds;
+  out["items"] = items * iterations;
+  out["unit"] = unit;
+  out["items_per_sec"] =
+      result.seconds > 0 ? (items * iterations) / result.seconds : 0;
+  // only passes over the whole corpus have a meaningful byte rate
+  if (unit == "lines" && result.seconds > 0)
+    out["mb_per_sec"] =
+        (corpus.bytes * iterations) / result.seconds / (1024 * 1024);
+  out["allocations_per_iteration"] = result.allocations / iterations;
+  out["allocated_bytes_per_iteration"] = result.allocatedBytes / iterations;
+  std::cout << out.dump() << std::endl;
+}
+static bool selected(const BenchConfig &config, const std::string &name) {
+  return config.filter.empty() || name.find(config.filter) != std::string::npos;
+}
+
+static void benchHighlighting(const BenchConfig &config, Corpus &corpus) {
+  if (!corpus.language)
+    return;
+  const int iterations = config.iterations;
+  if (selected(config, "highlight_full")) {
+    auto result = measure(iterations, [&]() {
+      Highlighter highlighter;
+      highlighter.setLanguage(*corpus.language, corpus.language->modeName);
+      highlighter.update(corpus.lines);
+    });
+    report(corpus, "highlight_full", iterations, result, corpus.lines.size(),
+           "lines");
+  }
+  if (selected(config, "highlight_edit")) {
+    Highlighter highlighter;
+    highlighter.setLanguage(*corpus.language, corpus.language->modeName);
+    highlighter.update(corpus.lines);
+    auto lines = corpus.lines;
+    const size_t edits = 1000;
+    Utf8String inserted("x");
+    auto result = measure(iterations, [&]() {
+      for (size_t i = 0; i < edits; i++) {
+        const size_t y = (i * 7919) % lines.size();
+        auto &line = lines[y];
+        line.insert(line.length() / 2, inserted);
+        // the edited line is reported like the cursor does
+        highlighter.update(lines, y, lines.size() - y - 1);
+      }
+    });
+    report(corpus, "highlight_edit", iterations, result, edits, "edits");
+  }
+}
+static void benchLayout(const BenchConfig &config, Corpus &corpus,
+                        FontAtlas &atlas) {
+  const int iterations = config.iterations;
+  const float lineHeight = atlas.atlas_height;
+  const float maxWidth = 900;
+  if (selected(config, "get_content")) {
+    Cursor cursor;
+    cursor.lines = corpus.lines;
+    cursor.setBounds(lineHeight * 60, lineHeight);
+    for (bool wrapping : {false, true}) {
+      auto result = measure(iterations, [&]() {
+        cursor.skip = 0;
+        for (size_t y = 0; y < cursor.lines.size(); y++) {
+          cursor.y = y;
+          cursor.x = cursor.lines[y].length();
+          cursor.getContent(&atlas, maxWidth, false, wrapping);
+        }
+      });
+      report(corpus, wrapping ? "get_content_wrapped" : "get_content",
+             iterations, result, corpus.lines.size(), "frames");
+    }
+  }
+  if (selected(config, "advance")) {
+    auto result = measure(iterations, [&]() {
+      float total = 0;
+      for (auto &line : corpus.lines)
+        total += atlas.getAdvance(line);
+      if (total < 0)
+        std::cerr << total;
+    });
+    report(corpus, "advance", iterations, result, corpus.lines.size(),
+           "lines");
+    auto prefixResult = measure(iterations, [&]() {
+      atlas.clearLineAdvances();
+      for (auto &line : corpus.lines)
+        atlas.getLineAdvances(line);
+    });
+    report(corpus, "advance_prefix", iterations, prefixResult,
+           corpus.lines.size(), "lines");
+    auto columnResult = measure(iterations, [&]() {
+      size_t total = 0;
+      for (auto &line : corpus.lines)
+        total +=
+            atlas.columnAt(line, atlas.advanceTo(line, line.length() / 2));
+      if (total == SIZE_MAX)
+        std::cerr << total;
+    });
+    report(corpus, "advance_column", iterations, columnResult,
+           corpus.lines.size(), "lines");
+    // an edit in the middle of the longest line measures only its chunk
+    auto longest = std::max_element(
+        corpus.lines.begin(), corpus.lines.end(),
+        [](auto &a, auto &b) { return a.length() < b.length(); });
+    if (longest != corpus.lines.end()) {
+      std::vector<Utf8String> lines(1, *longest);
+      const size_t edits = 100;
+      Utf8String inserted("x");
+      auto editResult = measure(iterations, [&]() {
+        for (size_t i = 0; i < edits; i++) {
+          auto &line = lines[0];
+          line.insert(line.length() / 2, inserted);
+          if (atlas.advanceTo(line, line.length() / 2) < 0)
+            std::cerr << "negative advance";
+        }
+      });
+      report(corpus, "advance_edit", iterations, editResult, edits, "edits");
+    }
+  }
+  if (selected(config, "glyph_instances")) {
+    Highlighter highlighter;
+    if (corpus.language)
+      highlighter.setLanguage(*corpus.language, corpus.language->modeName);
+    highlighter.update(corpus.lines);
+    EditorColors colors;
+    std::vector<RenderChar> entries;
+    uint64_t glyphs = 0;
+    auto result = measure(iterations, [&]() {
+      glyphs = 0;
+      for (size_t y = 0; y < corpus.lines.size(); y++) {
+        entries.clear();
+        auto &content = corpus.lines[y];
+        auto *spans = highlighter.getSpans(y);
+        float xpos = -maxWidth;
+        int column = 0;
+        size_t spanIndex = 0;
+        Vec4f color = colors.default_color;
+        for (auto c : content) {
+          if (spans && spanIndex + 1 < spans->size() &&
+              (*spans)[spanIndex + 1].start <= column) {
+            while (spanIndex + 1 < spans->size() &&
+                   (*spans)[spanIndex + 1].start <= column)
+              spanIndex++;
+            color = Highlighter::colorFor((*spans)[spanIndex].kind, &colors);
+          }
+          column++;
+          if (c != '\t')
+            entries.push_back(atlas.render(c, xpos, 0, color));
+          xpos += atlas.getAdvance(c);
+          if (xpos > maxWidth)
+            break;
+        }
+        glyphs += entries.size();
+      }
+    });
+    report(corpus, "glyph_instances", iterations, result, glyphs, "glyphs");
+  }
+  if (selected(config, "row_builder")) {
+    Highlighter highlighter;
+    if (corpus.language)
+      highlighter.setLanguage(*corpus.language, corpus.language->modeName);
+    highlighter.update(corpus.lines);
+    EditorColors colors;
+    RowBuilder builder;
+    builder.atlas = &atlas;
+    builder.colors = &colors;
+    builder.maxRenderWidth = maxWidth;
+    builder.lineHeight = lineHeight;
+    RowWorkers workers;
+    Cursor cursor;
+    cursor.lines = corpus.lines;
+    cursor.setBounds(lineHeight * 60, lineHeight);
+    // views spread over the document, at the end of their line like typing
+    const size_t frames = std::min(corpus.lines.size(), (size_t)50);
+    std::vector<RowRun> runs;
+    std::vector<RowJob> jobs;
+    uint64_t glyphs = 0;
+    for (bool parallel : {false, true}) {
+      auto result = measure(iterations, [&]() {
+        glyphs = 0;
+        for (size_t f = 0; f < frames; f++) {
+          cursor.y = f * corpus.lines.size() / frames;
+          cursor.x = cursor.lines[cursor.y].length();
+          auto *view = cursor.getContent(&atlas, maxWidth, false, false);
+          runs.resize(view->size());
+          jobs.resize(view->size());
+          for (size_t i = 0; i < view->size(); i++) {
+            runs[i].instances.clear();
+            runs[i].key.xOffset = cursor.xOffset;
+            jobs[i] = RowJob();
+            jobs[i].run = &runs[i];
+            jobs[i].content = (*view)[i];
+            jobs[i].spans = highlighter.getSpans(cursor.prepareStart + i);
+            jobs[i].x = -maxWidth;
+            jobs[i].y = i * lineHeight;
+          }
+          if (parallel) {
+            builder.buildAll(jobs, workers);
+          } else {
+            for (auto &job : jobs)
+              builder.build(job, true);
+          }
+          for (auto &run : runs)
+            glyphs += run.instances.size();
+        }
+      });
+      report(corpus, parallel ? "row_builder_parallel" : "row_builder",
+             iterations, result, glyphs, "glyphs");
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  BenchConfig config;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--font" && i + 1 < argc)
+      config.fontPath = argv[++i];
+    else if (arg == "--iterations" && i + 1 < argc)
+      config.iterations = std::max(1, atoi(argv[++i]));
+    else if (arg == "--filter" && i + 1 < argc)
+      config.filter = argv[++i];
+  }
+  if (config.fontPath.empty())
+    config.fontPath = Provider::getDefaultFontPath();
+
+  std::vector<Corpus> corpora;
+  corpora.push_back(syntheticCpp(50000));
+  Language rust;
+  fs::path sourceDir(LEDIT_SOURCE_DIR);
+  fs::path rustPath = sourceDir / "language-syntaxes" / "rust.json";
+  if (fs::exists(rustPath)) {
+    json parsed = json::parse(file_to_string(rustPath.generic_string()));
+    if (Provider::parseLanguage(parsed, rust))
+      corpora.push_back(syntheticRust(&rust, 50000));
+  } else {
+    std::cerr << "missing " << rustPath.generic_string() << "\n";
+  }
+  for (auto *name : {"cursor.h", "main.cc", "state.h"}) {
+    Corpus corpus{std::string("cpp_") + name, &LANGUAGES[0]};
+    if (loadSourceFile(corpus, (sourceDir / "src" / name).generic_string()))
+      corpora.push_back(corpus);
+  }
+  corpora.push_back(minifiedJson(20000));
+  corpora.push_back(longLineLog(2000, 4000));
+
+  for (auto &corpus : corpora)
+    benchHighlighting(config, corpus);
+
+  FontAtlas atlas(config.fontPath, 30, true);
+  if (atlas.errors.size() || atlas.faces.empty()) {
+    std::cerr << "failed to load font " << config.fontPath
+              << ", skipping layout benchmarks\n";
+    return 0;
+  }
+  atlas.ensureTab();
+  for (auto &corpus : corpora)
+    benchLayout(config, corpus, atlas);
+  return 0;
+}
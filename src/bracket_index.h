@@ -0,0 +1,463 @@
+#ifndef BRACKET_INDEX_H
+#define BRACKET_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+struct BracketEntry {
+  int x;
+  uint8_t type;
+  bool open;
+  // depth over all types before it, counted from the start of its line
+  int depth = 0;
+};
+/*
+  Bracket positions per line (without the ones inside strings and comments),
+  runs of lines are summarized in one segment tree per bracket type so
+  finding the matching bracket does not need to walk the document in
+  between. Inserted or removed lines only change the run they're in.
+*/
+class BracketIndex {
+public:
+  static const int TYPES = 3;
+  // same order as PAIRS
+  static int bracketType(char32_t c, bool &open) {
+    switch (c) {
+    case '{':
+      open = true;
+      return 0;
+    case '}':
+      open = false;
+      return 0;
+    case '(':
+      open = true;
+      return 1;
+    case ')':
+      open = false;
+      return 1;
+    case '[':
+      open = true;
+      return 2;
+    case ']':
+      open = false;
+      return 2;
+    default:
+      return -1;
+    }
+  }
+  size_t lineCount() const { return lines.size(); }
+  const std::vector<BracketEntry> &getLine(size_t y) const { return lines[y]; }
+  void reset() {
+    lines.clear();
+    blocks.clear();
+    dirty.clear();
+    layoutChanged = true;
+    commit();
+  }
+  /*
+    Replaces removed lines at start by inserted empty ones, only the blocks
+    holding them are summarized again.
+  */
+  void splice(size_t start, size_t removed, size_t inserted) {
+    lines.erase(lines.begin() + start, lines.begin() + start + removed);
+    lines.insert(lines.begin() + start, inserted, std::vector<BracketEntry>());
+    if (blocks.empty()) {
+      blocks.emplace_back();
+      fenwick.assign(2, 0);
+      layoutChanged = true;
+    }
+    size_t first;
+    const size_t block = blockOf(start, first);
+    size_t left = removed;
+    for (size_t b = block; left && b < blocks.size(); b++) {
+      size_t offset = b == block ? start - first : 0;
+      size_t taken = std::min(left, blocks[b].size - offset);
+      if (taken) {
+        resize(b, -(int64_t)taken);
+        markDirty(b);
+      }
+      left -= taken;
+    }
+    if (inserted) {
+      resize(block, inserted);
+      markDirty(block);
+    }
+  }
+  void setLine(size_t y, std::vector<BracketEntry> &&entries) {
+    int depth = 0;
+    for (auto &entry : entries) {
+      entry.depth = depth;
+      depth += entry.open ? 1 : -1;
+    }
+    lines[y] = std::move(entries);
+    size_t first;
+    markDirty(blockOf(y, first));
+  }
+  void commit() {
+    for (auto b : dirty) {
+      if (blocks[b].size > BLOCK_LINES * 2)
+        layoutChanged = true;
+    }
+    if (layoutChanged) {
+      relayout();
+    } else {
+      for (auto b : dirty) {
+        summarize(blocks[b], blockStart(b));
+        blocks[b].dirty = false;
+        updateLeaf(b);
+      }
+    }
+    dirty.clear();
+    layoutChanged = false;
+  }
+  /*
+    Returns the coordinates of the bracket matching the one at x/y,
+    {-1, -1} when it has no partner and {-2, -2} when there is no indexed
+    bracket at x/y (for example because it's part of a string).
+  */
+  std::pair<int, int> findMatching(int x, int y) const {
+    if (y < 0 || y >= (int)lines.size())
+      return std::pair(-2, -2);
+    const auto &line = lines[y];
+    auto it = std::lower_bound(
+        line.begin(), line.end(), x,
+        [](const BracketEntry &e, int value) { return e.x < value; });
+    if (it == line.end() || it->x != x)
+      return std::pair(-2, -2);
+    const uint8_t type = it->type;
+    int acc = 0;
+    if (it->open) {
+      for (auto e = it + 1; e != line.end(); e++) {
+        if (e->type != type)
+          continue;
+        acc += e->open ? 1 : -1;
+        if (acc == -1)
+          return std::pair(e->x, y);
+      }
+      int64_t target = lineForward(y + 1, type, acc);
+      if (target == -1)
+        return std::pair(-1, -1);
+      for (const auto &e : lines[target]) {
+        if (e.type != type)
+          continue;
+        acc += e.open ? 1 : -1;
+        if (acc == -1)
+          return std::pair(e.x, (int)target);
+      }
+    } else {
+      return findOpening(it, y, type);
+    }
+    return std::pair(-1, -1);
+  }
+  /*
+    Nesting depth over all bracket types at the start of line y, the block
+    sums in the trees act as stored prefix depths so this only rescans the
+    lines of one block.
+  */
+  int depthBefore(size_t y) const {
+    if (y > lines.size())
+      y = lines.size();
+    if (blocks.empty())
+      return 0;
+    size_t first;
+    const size_t block = blockOf(y, first);
+    int depth = 0;
+    for (uint8_t type = 0; type < TYPES; type++) {
+      const auto &tree = trees[type];
+      for (size_t l = leaves, r = leaves + block; l < r; l /= 2, r /= 2) {
+        if (l & 1)
+          depth += tree[l++].sum;
+        if (r & 1)
+          depth += tree[--r].sum;
+      }
+    }
+    for (size_t l = first; l < y; l++) {
+      for (const auto &e : lines[l])
+        depth += e.open ? 1 : -1;
+    }
+    return depth;
+  }
+  // opening bracket of the innermost pair of the given type around x/y
+  std::pair<int, int> findEnclosing(int x, int y, uint8_t type) const {
+    if (y < 0 || y >= (int)lines.size())
+      return std::pair(-1, -1);
+    const auto &line = lines[y];
+    auto it = std::lower_bound(
+        line.begin(), line.end(), x,
+        [](const BracketEntry &e, int value) { return e.x < value; });
+    if (it != line.end() && it->x == x && it->type == type) {
+      if (it->open)
+        return std::pair(x, y);
+      return findMatching(x, y);
+    }
+    return findOpening(it, y, type);
+  }
+
+private:
+  struct Node {
+    int sum = 0;
+    int minPrefix = 0;
+    int maxSuffix = 0;
+  };
+  // lines summarized together in one leaf of the trees
+  struct Block {
+    size_t size = 0;
+    Node sums[TYPES];
+    bool dirty = false;
+  };
+  // blocks are split above twice this and joined while they fit in it
+  static constexpr size_t BLOCK_LINES = 64;
+  std::vector<std::vector<BracketEntry>> lines;
+  std::vector<Block> blocks;
+  // block sizes as a fenwick tree, finds the block of a line
+  std::vector<size_t> fenwick;
+  std::vector<Node> trees[TYPES];
+  std::vector<size_t> dirty;
+  size_t leaves = 1;
+  bool layoutChanged = true;
+
+  // walks backwards from before `it` until an opening bracket is unmatched
+  std::pair<int, int>
+  findOpening(std::vector<BracketEntry>::const_iterator it, int y,
+              uint8_t type) const {
+    const auto &line = lines[y];
+    int acc = 0;
+    for (auto e = it; e != line.begin();) {
+      e--;
+      if (e->type != type)
+        continue;
+      acc += e->open ? 1 : -1;
+      if (acc == 1)
+        return std::pair(e->x, y);
+    }
+    if (y == 0)
+      return std::pair(-1, -1);
+    int64_t target = lineBackward(y - 1, type, acc);
+    if (target == -1)
+      return std::pair(-1, -1);
+    const auto &targetLine = lines[target];
+    for (auto e = targetLine.rbegin(); e != targetLine.rend(); e++) {
+      if (e->type != type)
+        continue;
+      acc += e->open ? 1 : -1;
+      if (acc == 1)
+        return std::pair(e->x, (int)target);
+    }
+    return std::pair(-1, -1);
+  }
+  // first line >= from where the running depth drops below zero
+  int64_t lineForward(size_t from, uint8_t type, int &acc) const {
+    if (from >= lines.size())
+      return -1;
+    size_t first;
+    size_t block = blockOf(from, first);
+    size_t end = first + blocks[block].size;
+    for (size_t y = from; y < end; y++) {
+      Node n = summarize(lines[y], type);
+      if (acc + n.minPrefix < 0)
+        return y;
+      acc += n.sum;
+    }
+    int64_t target =
+        findForward(trees[type], 1, 0, leaves - 1, block + 1, acc);
+    if (target == -1)
+      return -1;
+    first = blockStart(target);
+    for (size_t y = first; y < first + blocks[target].size; y++) {
+      Node n = summarize(lines[y], type);
+      if (acc + n.minPrefix < 0)
+        return y;
+      acc += n.sum;
+    }
+    return -1;
+  }
+  // last line <= to where the running depth, walking backwards, rises above
+  // zero
+  int64_t lineBackward(size_t to, uint8_t type, int &acc) const {
+    size_t first;
+    size_t block = blockOf(to, first);
+    for (size_t y = to + 1; y-- > first;) {
+      Node n = summarize(lines[y], type);
+      if (acc + n.maxSuffix >= 1)
+        return y;
+      acc += n.sum;
+    }
+    if (block == 0)
+      return -1;
+    int64_t target =
+        findBackward(trees[type], 1, 0, leaves - 1, block - 1, acc);
+    if (target == -1)
+      return -1;
+    first = blockStart(target);
+    for (size_t y = first + blocks[target].size; y-- > first;) {
+      Node n = summarize(lines[y], type);
+      if (acc + n.maxSuffix >= 1)
+        return y;
+      acc += n.sum;
+    }
+    return -1;
+  }
+  static Node combine(const Node &a, const Node &b) {
+    Node n;
+    n.sum = a.sum + b.sum;
+    n.minPrefix = std::min(a.minPrefix, a.sum + b.minPrefix);
+    n.maxSuffix = std::max(b.maxSuffix, b.sum + a.maxSuffix);
+    return n;
+  }
+  static Node summarize(const std::vector<BracketEntry> &line, uint8_t type) {
+    Node n;
+    for (const auto &e : line) {
+      if (e.type != type)
+        continue;
+      n.sum += e.open ? 1 : -1;
+      n.minPrefix = std::min(n.minPrefix, n.sum);
+    }
+    // the largest suffix is what's left after the smallest prefix
+    n.maxSuffix = n.sum - n.minPrefix;
+    return n;
+  }
+  void summarize(Block &b, size_t first) const {
+    for (uint8_t type = 0; type < TYPES; type++) {
+      Node n;
+      for (size_t y = first; y < first + b.size; y++)
+        n = combine(n, summarize(lines[y], type));
+      b.sums[type] = n;
+    }
+  }
+  void markDirty(size_t block) {
+    if (blocks[block].dirty)
+      return;
+    blocks[block].dirty = true;
+    dirty.push_back(block);
+  }
+  void resize(size_t block, int64_t delta) {
+    blocks[block].size += delta;
+    for (size_t i = block + 1; i < fenwick.size(); i += i & -i)
+      fenwick[i] += delta;
+  }
+  // first line of block
+  size_t blockStart(size_t block) const {
+    size_t sum = 0;
+    for (size_t i = block; i > 0; i -= i & -i)
+      sum += fenwick[i];
+    return sum;
+  }
+  // non empty block holding line y, the last block for y past the end
+  size_t blockOf(size_t y, size_t &first) const {
+    size_t pos = 0;
+    size_t sum = 0;
+    size_t step = 1;
+    while (step * 2 < fenwick.size())
+      step *= 2;
+    for (; step > 0; step /= 2) {
+      if (pos + step < fenwick.size() && sum + fenwick[pos + step] <= y) {
+        pos += step;
+        sum += fenwick[pos];
+      }
+    }
+    if (pos >= blocks.size()) {
+      pos = blocks.size() - 1;
+      sum -= blocks[pos].size;
+    }
+    first = sum;
+    return pos;
+  }
+  /*
+    Splits blocks that grew too large, joins small neighbours and drops
+    empty ones, then rebuilds the trees from the block sums. Only blocks
+    whose lines changed are summarized again.
+  */
+  void relayout() {
+    std::vector<Block> next;
+    size_t y = 0;
+    for (auto &block : blocks) {
+      if (block.dirty) {
+        for (size_t offset = 0; offset < block.size; offset += BLOCK_LINES) {
+          Block part;
+          part.size = std::min(BLOCK_LINES, block.size - offset);
+          summarize(part, y + offset);
+          next.push_back(part);
+        }
+      } else if (block.size) {
+        if (next.size() && next.back().size + block.size <= BLOCK_LINES) {
+          auto &last = next.back();
+          last.size += block.size;
+          for (uint8_t type = 0; type < TYPES; type++)
+            last.sums[type] = combine(last.sums[type], block.sums[type]);
+        } else {
+          next.push_back(block);
+        }
+      }
+      y += block.size;
+    }
+    if (next.empty())
+      next.emplace_back();
+    blocks.swap(next);
+    fenwick.assign(blocks.size() + 1, 0);
+    for (size_t b = 0; b < blocks.size(); b++) {
+      fenwick[b + 1] += blocks[b].size;
+      size_t parent = (b + 1) + ((b + 1) & -(b + 1));
+      if (parent < fenwick.size())
+        fenwick[parent] += fenwick[b + 1];
+    }
+    leaves = 1;
+    while (leaves < blocks.size())
+      leaves *= 2;
+    for (uint8_t type = 0; type < TYPES; type++) {
+      auto &tree = trees[type];
+      tree.assign(leaves * 2, Node());
+      for (size_t b = 0; b < blocks.size(); b++)
+        tree[leaves + b] = blocks[b].sums[type];
+      for (size_t i = leaves - 1; i > 0; i--)
+        tree[i] = combine(tree[i * 2], tree[i * 2 + 1]);
+    }
+  }
+  void updateLeaf(size_t block) {
+    for (uint8_t type = 0; type < TYPES; type++) {
+      auto &tree = trees[type];
+      size_t i = leaves + block;
+      tree[i] = blocks[block].sums[type];
+      for (i /= 2; i > 0; i /= 2)
+        tree[i] = combine(tree[i * 2], tree[i * 2 + 1]);
+    }
+  }
+  // first block >= from where the running depth drops below zero
+  int64_t findForward(const std::vector<Node> &tree, size_t node, size_t nl,
+                      size_t nr, size_t from, int &acc) const {
+    if (nr < from)
+      return -1;
+    if (nl >= from && acc + tree[node].minPrefix > -1) {
+      acc += tree[node].sum;
+      return -1;
+    }
+    if (nl == nr)
+      return nl;
+    size_t mid = (nl + nr) / 2;
+    auto found = findForward(tree, node * 2, nl, mid, from, acc);
+    if (found != -1)
+      return found;
+    return findForward(tree, node * 2 + 1, mid + 1, nr, from, acc);
+  }
+  // last block <= to where the running depth, walking backwards, rises above
+  // zero
+  int64_t findBackward(const std::vector<Node> &tree, size_t node, size_t nl,
+                       size_t nr, size_t to, int &acc) const {
+    if (nl > to)
+      return -1;
+    if (nr <= to && acc + tree[node].maxSuffix < 1) {
+      acc += tree[node].sum;
+      return -1;
+    }
+    if (nl == nr)
+      return nl;
+    size_t mid = (nl + nr) / 2;
+    auto found = findBackward(tree, node * 2 + 1, mid + 1, nr, to, acc);
+    if (found != -1)
+      return found;
+    return findBackward(tree, node * 2, nl, mid, to, acc);
+  }
+};
+
+#endif
@@ -1,17 +1,20 @@
 #ifndef CURSOR_H
 #define CURSOR_H
 
+#include <algorithm>
 #include <string>
 #include <map>
 #include <vector>
 #include <sstream>
 #include <fstream>
 #include "font_atlas.h"
+#include "highlighting.h"
 #include "selection.h"
 #include <deque>
 #include "u8String.h"
 #include "utf8String.h"
 #include "utils.h"
+#include "wrap_layout.h"
 #ifndef __APPLE__
 #include <filesystem>
 #endif
@@ -26,6 +29,13 @@ struct HistoryEntry {
   Utf8String content;
   std::vector<Utf8String> extra;
 };
+// a line of the view, columns begin to end of a line of the document
+struct ViewLine {
+  const Utf8String *line;
+  size_t begin;
+  size_t end;
+  size_t length() const { return end - begin; }
+};
 struct CommentEntry {
   int firstOffset;
   int yStart;
@@ -46,6 +56,15 @@ public:
   int y = 0;
   int xSave = 0;
   int skip = 0;
+  // fraction of a line the view is scrolled past skip, drawn as an offset
+  float scroll = 0;
+  // set while the view was scrolled away from the cursor, until it moves
+  bool detached = false;
+  int detachedX = 0;
+  int detachedY = 0;
+  // line of prepare[0], lines around the view are laid out ahead
+  int prepareStart = 0;
+  static const int SCROLL_BAND = 8;
   int xOffset = 0;
   float xSkip = 0;
   float height = 0;
@@ -59,8 +78,32 @@ public:
 
   float startX = 0;
   float startY = 0;
-  std::vector<std::pair<int, Utf8String>> prepare;
+  // the lines getContent hands out, valid until lines changes
+  std::vector<ViewLine> prepare;
+  // rows of wrapped lines, laid out at the start of each frame
+  WrapLayout wrap;
   Utf8String *bind = nullptr;
+  Highlighter *highlighter = nullptr;
+  /*
+    Lines edited since the highlighter last saw them, from dirtyFrom up to
+    the last dirtyTail lines. The edit paths report them, so updating the
+    highlighter doesn't compare every line of the buffer.
+  */
+  size_t dirtyFrom = 0;
+  size_t dirtyTail = 0;
+  // lines from up to to were changed or inserted, called after the edit
+  void markEdited(size_t from, size_t to) {
+    dirtyFrom = std::min(dirtyFrom, from);
+    dirtyTail = std::min(dirtyTail, lines.size() - std::min(to, lines.size()));
+  }
+  void markAllEdited() { markEdited(0, lines.size()); }
+  void updateHighlighter() {
+    if (!highlighter)
+      return;
+    highlighter->update(lines, dirtyFrom, dirtyTail);
+    dirtyFrom = SIZE_MAX;
+    dirtyTail = SIZE_MAX;
+  }
   void setBounds(float height, float lineHeight) {
     this->height = height;
     this->lineHeight = lineHeight;
@@ -96,6 +139,7 @@ public:
         line = line.substr(0, line.length() - count);
       }
     }
+    markAllEdited();
     if (x > getCurrentLineLength())
       x = getCurrentLineLength();
   }
@@ -121,6 +165,7 @@ public:
         (&lines[y])->insert(firstOffset, commentStr);
         historyPush(43, firstOffset, U"", cm);
       }
+      markEdited(y, y + 1);
       return;
     }
     int firstOffset = 0;
@@ -152,6 +197,7 @@ public:
         (&lines[i])->insert(firstOffset, commentStr);
       }
     }
+    markEdited(yStart, yEnd);
     selection.stop();
   }
   void resetCursor() {
@@ -168,44 +214,21 @@ public:
       return;
     if (mouseY < startY)
       return;
-    int targetY = floor((mouseY - startY) / lineHeight);
+    int targetY = floor((mouseY - startY) / lineHeight + scroll);
 
     if (lineWrapping) {
-      auto sY = startY + lineHeight;
-      auto sX = startX;
-      size_t xx = 0;
-      size_t yy = skip;
-      while (sY <= mouseY) {
-        if (yy == lines.size())
-          break;
-        if (xx == lines[yy].length()) {
-          sY += lineHeight;
-          sX = startX;
-          xx = 0;
-          yy++;
-          continue;
-        }
-        auto w = atlas->getAdvance(lines[yy][xx]);
-        sX += w;
-        xx++;
-        if (sX - startX * 2 > maxWidth * 2) {
-          sY += lineHeight;
-          sX = startX + w;
-        }
-      }
-      if (yy == lines.size())
-        yy--;
-      while (sX < mouseX) {
-        if (xx == lines[yy].size())
-          break;
-        auto w = atlas->getAdvance(lines[yy][xx]);
-        sX += w;
-        xx++;
-      }
-      if (xx > lines[yy].size())
-        xx = lines[yy].size();
-      x = xx > 0 ? xx - 1 : xx;
-      y = yy;
+      wrap.configure(*atlas, maxWidth * 2);
+      if (!wrap.viewing(lines, skip))
+        wrap.beginView(lines, skip);
+      auto row = wrap.at(wrap.rowOf(skip, 0) + targetY);
+      auto &line = lines[row.line];
+      size_t last = row.end < line.length() ? row.end - 1 : row.end;
+      size_t column = row.begin;
+      if (mouseX > startX)
+        column = atlas->columnAt(line, atlas->advanceTo(line, row.begin) +
+                                           mouseX - startX);
+      x = std::min(std::max(column, row.begin), last);
+      y = row.line;
       selection.diffX(x);
       selection.diffY(y);
       return;
@@ -214,19 +237,9 @@ public:
       targetY = lines.size() - 1;
     else
       targetY += skip;
-    auto *line = &lines[targetY];
     int targetX = 0;
-    if (mouseX > startX) {
-      mouseX -= startX;
-      auto *advances = atlas->getAllAdvance(*line, targetY);
-      float acc = 0;
-      for (auto &entry : *advances) {
-        acc += entry;
-        if (acc > mouseX)
-          break;
-        targetX++;
-      }
-    }
+    if (mouseX > startX)
+      targetX = atlas->columnAt(lines[targetY], mouseX - startX);
     x = targetX;
     y = targetY;
     selection.diffX(x);
@@ -240,6 +253,7 @@ public:
     prepare.clear();
     history.clear();
     lines = {U""};
+    markAllEdited();
   }
   void deleteSelection() {
     if (selection.yStart == selection.yEnd) {
@@ -248,6 +262,7 @@ public:
       auto start = line.substr(0, selection.getXSmaller());
       auto end = line.substr(selection.getXBigger());
       lines[y] = start + end;
+      markEdited(y, y + 1);
       x = start.length();
     } else {
       int ySmall = selection.getYSmaller();
@@ -267,6 +282,7 @@ public:
         lines.erase(lines.begin() + ySmall + 1);
       }
       y = ySmall;
+      markEdited(y, y + 1);
       historyPushWithExtra(16, save.length(), save, toSave);
     }
   }
@@ -364,6 +380,7 @@ public:
         if (line.length() - where - what.length() > 0)
           base += line.substr(where + what.length());
         lines[x] = base;
+        markEdited(x, x + 1);
         if (allowCenter) {
           this->y = i;
           center(i);
@@ -426,6 +443,14 @@ public:
   }
   std::pair<int, int> findMatchingWithCoords(int inx, int iny) {
     bool isBinding = bind != nullptr;
+    if (!isBinding && highlighter) {
+      updateHighlighter();
+      auto res = highlighter->brackets.findMatching(
+          (size_t)x == lines[y].length() ? x - 1 : x, y);
+      // brackets inside strings or comments are not indexed
+      if (res.first != -2)
+        return res;
+    }
     Utf8String &active = isBinding ? *bind : lines[y];
     char32_t current = active[x == lines[y].length() ? x - 1 : x];
     const std::pair<char32_t, char32_t> *pair = nullptr;
@@ -495,6 +520,24 @@ public:
     }
     return std::pair(-1, -1);
   }
+  /*
+    Bracket of the pair around inx/iny that text objects start from, the
+    opening one or with closing set the closing one.
+  */
+  std::pair<int, int> findPairBoundary(const std::pair<char32_t, char32_t> &pair,
+                                       bool closing, int inx, int iny) {
+    if (bind == nullptr && highlighter) {
+      updateHighlighter();
+      bool open;
+      int type = BracketIndex::bracketType(pair.first, open);
+      auto res = highlighter->brackets.findEnclosing(inx, iny, type);
+      if (!closing || res.first == -1)
+        return res;
+      return highlighter->brackets.findMatching(res.first, res.second);
+    }
+    return findGlobal(!closing, Utf8String(1, closing ? pair.second : pair.first),
+                      inx, iny);
+  }
   int findAnyOfLast(Utf8String str, Utf8String what) {
     if (str.length() == 0)
       return -1;
@@ -594,33 +637,15 @@ public:
   std::pair<float, float> getPosLineWrapped(FontAtlas &atlas, float xBase,
                                             float yBase, float maxRenderWidth,
                                             float lineHeight, int x, int y) {
-    float cursorX = xBase;
-    float cursorY = yBase;
-    for (size_t i = skip; i < y; i++) {
-      const Utf8String &ref = lines[i];
-      auto vec = ref.getCodePoints();
-      for (char32_t e : vec) {
-        cursorX += atlas.getAdvance(e);
-        if (cursorX > maxRenderWidth + atlas.getAdvance(e)) {
-          cursorY += lineHeight;
-          cursorX = xBase;
-        }
-      }
-      cursorY += lineHeight;
-      cursorX = xBase;
-    }
-    if (x > 0) {
-      const Utf8String &ref = lines[y];
-      auto vec = ref.getCodePointsRange(0, x);
-      for (char32_t e : vec) {
-        cursorX += atlas.getAdvance(e);
-        if (cursorX > maxRenderWidth + atlas.getAdvance(e)) {
-          cursorY += lineHeight;
-          cursorX = xBase;
-        }
-      }
-    }
-    return std::pair(cursorX, cursorY);
+    wrap.configure(atlas, maxRenderWidth - xBase);
+    if (!wrap.viewing(lines, skip))
+      wrap.beginView(lines, skip);
+    // count from the upper of the cursor and the top of the view
+    wrap.extendTo(std::min(y, skip));
+    int row = wrap.rowOf(y, x) - wrap.rowOf(skip, 0);
+    float cursorX =
+        xBase + atlas.advanceBetween(lines[y], wrap.rowStart(lines[y], x), x);
+    return std::pair(cursorX, yBase + row * lineHeight);
   }
 
   void setCurrent(char32_t character) {
@@ -629,35 +654,20 @@ public:
     Utf8String temp;
     temp += lines[y][x];
     lines[y].set(x, character);
+    markEdited(y, y + 1);
     historyPush(51, 1, temp);
   }
+  // lines from skip on whose rows fill height, the last one may be cut
   int getMaxLinesWrapped(FontAtlas &atlas, float xBase, float yBase,
                          float maxRenderWidth, float lineHeight, float height) {
-    int count = 0;
-    float heightRemaining = height;
-    float cursorX = xBase;
-    float cursorY = yBase;
-    for (size_t i = skip; i < lines.size(); i++) {
-      const Utf8String &ref = lines[i];
-      auto vec = ref.getCodePoints();
-      for (char32_t e : vec) {
-        cursorX += atlas.getAdvance(e);
-        if (cursorX > maxRenderWidth + atlas.getAdvance(e)) {
-          cursorY += lineHeight;
-          cursorX = xBase;
-          heightRemaining -= lineHeight;
-        }
-      }
-      cursorY += lineHeight;
-      cursorX = xBase;
-      heightRemaining -= lineHeight;
-      count++;
-      if (heightRemaining <= 0)
-        break;
-    }
-
-
-    return count;
+    if ((size_t)skip >= lines.size())
+      return 0;
+    wrap.configure(atlas, maxRenderWidth - xBase);
+    if (!wrap.viewing(lines, skip))
+      wrap.beginView(lines, skip);
+    int rows = lineHeight > 0 ? (int)std::ceil(height / lineHeight) : 1;
+    return wrap.at(wrap.rowOf(skip, 0) + std::max(rows, 1) - 1).line - skip +
+           1;
   }
   Utf8String deleteLines(int64_t start, int64_t am, bool del = true) {
     if (start < 0)
@@ -674,6 +684,7 @@ public:
       if (lines.size() == 0)
         lines.push_back(U"");
       lines.erase(lines.begin() + start, lines.begin() + start + am);
+      markEdited(start, start);
       historyPushWithExtra(50, 0, U"", ll);
     }
 
@@ -692,6 +703,7 @@ public:
       offset = target->length() - x;
     Utf8String w = target->substr(x, offset);
     target->erase(x, offset);
+    markEdited(y, y + 1);
     historyPush(3, w.length(), w);
     return w;
   }
@@ -739,6 +751,7 @@ public:
     if (del) {
 
       target.erase(x, length);
+      markEdited(y, y + 1);
       historyPush(3, w.length(), w);
     }
     return w;
@@ -753,7 +766,7 @@ public:
     Utf8String w = target->substr(x - offset, offset);
     if (!onlyCopy) {
       target->erase(x - offset, offset);
-
+      markEdited(y, y + 1);
       historyPush(3, w.length(), w);
     }
     x = x - offset;
@@ -769,6 +782,7 @@ public:
       x = entry.x;
       y = entry.y;
       (&lines[y])->erase(x, entry.length);
+      markEdited(y, y + 1);
       center(y);
       break;
     }
@@ -777,6 +791,7 @@ public:
       y = entry.y;
       center(y);
       (&lines[y])->insert(x, entry.content);
+      markEdited(y, y + 1);
       x += entry.length;
       break;
     }
@@ -785,6 +800,7 @@ public:
       x = entry.x;
       center(y);
       (&lines[y])->insert(x - 1, entry.content);
+      markEdited(y, y + 1);
       break;
     }
     case 5: {
@@ -794,12 +810,14 @@ public:
       center(y);
       if (entry.extra.size())
         lines[y - 1] = entry.extra[0];
+      markEdited(y > 0 ? y - 1 : 0, y + 1);
       break;
     }
     case 6: {
       y = entry.y;
       x = (&lines[y])->length();
       lines.erase(lines.begin() + y + 1);
+      markEdited(y, y + 1);
       center(y);
       break;
     }
@@ -812,6 +830,7 @@ public:
       } else {
         lines.erase(lines.begin() + y);
       }
+      markEdited(y, y + 1);
       center(y);
       break;
     }
@@ -819,6 +838,7 @@ public:
       y = entry.y;
       x = entry.x;
       (&lines[y])->erase(x, 1);
+      markEdited(y, y + 1);
       center(y);
       break;
     }
@@ -827,6 +847,7 @@ public:
       y = entry.y;
       lines[y] = entry.content;
       lines.insert(lines.begin() + y, U"");
+      markEdited(y, y + 2);
       center(y);
       break;
     }
@@ -834,6 +855,7 @@ public:
       y = entry.y;
       x = entry.x;
       (&lines[y])->insert(x, entry.content);
+      markEdited(y, y + 1);
       break;
     }
     case 15: {
@@ -849,6 +871,7 @@ public:
         }
         lines[y] = entry.content;
       }
+      markEdited(y, y + 1);
       break;
     }
     case 16: {
@@ -865,12 +888,14 @@ public:
         x = entry.x;
         lines[y] = entry.content;
       }
+      markEdited(y, y + 1 + entry.extra.size());
       break;
     }
     case 30: {
       y = entry.y;
       x = entry.x;
       lines[y] = entry.content;
+      markEdited(y, y + 1);
       break;
     }
     case 31: {
@@ -888,6 +913,7 @@ public:
       for (size_t i = data->yStart; i < data->yStart + len; i++) {
         (&lines[i])->insert(data->firstOffset, commentStr);
       }
+      markEdited(data->yStart, data->yStart + len);
       x = data->firstOffset;
       y = data->yStart;
       center(y);
@@ -901,6 +927,7 @@ public:
       for (size_t i = data->yStart; i < data->yStart + len; i++) {
         (&lines[i])->erase(data->firstOffset, commentStr.length());
       }
+      markEdited(data->yStart, data->yStart + len);
       x = data->firstOffset;
       y = data->yStart;
       center(y);
@@ -912,6 +939,7 @@ public:
       center(y);
       CommentEntry *data = static_cast<CommentEntry *>(entry.userData);
       (&lines[y])->insert(entry.length, data->commentStr);
+      markEdited(y, y + 1);
       x = entry.x;
       delete data;
       break;
@@ -921,6 +949,7 @@ public:
       center(y);
       CommentEntry *data = static_cast<CommentEntry *>(entry.userData);
       (&lines[y])->erase(entry.length, data->commentStr.length());
+      markEdited(y, y + 1);
       x = entry.x;
       delete data;
       break;
@@ -930,18 +959,21 @@ public:
       x = entry.x;
       for (size_t i = 0; i < entry.extra.size(); i++)
         lines.insert(lines.begin() + y + i, entry.extra[i]);
+      markEdited(y, y + entry.extra.size());
       break;
     }
     case 51: {
       y = entry.y;
       x = entry.x;
       lines[y].set(x, entry.content[0]);
+      markEdited(y, y + 1);
       break;
     }
     case 53: {
       y = entry.y;
       x = entry.x;
       lines.erase(lines.begin() + y + 1, lines.begin() + 1 + y + entry.length);
+      markEdited(y, y + 1);
       break;
     }
     default:
@@ -1139,6 +1171,7 @@ public:
       lines[count] = create(ref);
       count++;
     }
+    markAllEdited();
     if (skip > lines.size() - maxLines)
       skip = 0;
     if (y > lines.size() - 1)
@@ -1190,6 +1223,7 @@ public:
       lines[count] = create(ref);
       count++;
     }
+    markAllEdited();
     if (skip > lines.size() - maxLines)
       skip = 0;
     if (y > lines.size() - 1)
@@ -1221,6 +1255,7 @@ public:
             break;
         }
         lines.insert(pos + 1, base);
+        markEdited(y, y + 2);
         historyPush(6, 0, U"");
         x = base.length();
         y++;
@@ -1238,6 +1273,7 @@ public:
           historyPushWithExtra(7, toWrite.length(), toWrite, {next});
         }
       }
+      markEdited(y, y + 2);
       y++;
       x = 0;
     } else {
@@ -1245,6 +1281,7 @@ public:
       Utf8String content;
       content += c;
       target->insert(x, content);
+      markEdited(y, y + 1);
       historyPush(8, 1, content);
       x++;
     }
@@ -1273,6 +1310,7 @@ public:
         lines.insert(lines.begin() + y + off, l);
         y++;
       }
+      markEdited(y - contentLines.size(), y + off);
       return;
     }
     int saveX = 0;
@@ -1310,22 +1348,24 @@ public:
       historyPush(15, count, historySave);
       x = xx;
     }
+    markEdited(y - count, y + 1);
     center(y);
   }
   void append(Utf8String content) {
     auto *target = bind ? bind : &lines[y];
     target->insert(x, content);
+    markEdited(y, y + 1);
     historyPush(2, content.length(), content);
     x += content.length();
   }
 
-  Utf8String getCurrentAdvance(bool useSaveValue = false) {
+  float getCurrentAdvance(FontAtlas &atlas, bool useSaveValue = false) {
     if (useSaveValue)
-      return lines[y].substr(0, xSave);
+      return atlas.advanceTo(lines[y], xSave);
 
     if (bind)
-      return bind->substr(0, x);
-    return lines[y].substr(0, x);
+      return atlas.advanceTo(*bind, x);
+    return atlas.advanceTo(lines[y], x);
   }
   char32_t removeBeforeCursor() {
     if (selection.active)
@@ -1340,6 +1380,7 @@ public:
         Utf8String next = lines[y + 1];
         lines[y] = next;
         lines.erase(lines.begin() + y + 1);
+        markEdited(y, y + 1);
         historyPush(10, next.length(), next);
         return '\n';
       }
@@ -1348,6 +1389,7 @@ public:
     auto out = (*target)[x];
     historyPush(11, 1, Utf8String(1, out));
     target->erase(x, 1);
+    markEdited(y, y + 1);
 
     if (x > target->length())
       x = target->length();
@@ -1380,7 +1422,7 @@ public:
         historyPush(5, (&lines[y])->length(), lines[y]);
       }
       lines.erase(lines.begin() + y);
-
+      markEdited(y - 1, y);
       y--;
       x = xTarget;
       return '\n';
@@ -1388,6 +1430,7 @@ public:
       char32_t out = (*target)[x - 1];
       historyPush(4, 1, Utf8String(1, (*target)[x - 1]));
       target->erase(x - 1, 1);
+      markEdited(y, y + 1);
       x--;
       return out;
     }
@@ -1485,10 +1528,9 @@ public:
     edited = false;
     return true;
   }
-  std::vector<std::pair<int, Utf8String>> *getContent(FontAtlas *atlas,
-                                                      float maxWidth,
-                                                      bool onlyCalculate,
-                                                      bool lineWrapping) {
+  const std::vector<ViewLine> *getContent(FontAtlas *atlas, float maxWidth,
+                                          bool onlyCalculate,
+                                          bool lineWrapping) {
     prepare.clear();
     int end = skip + maxLines;
     if (end >= lines.size()) {
@@ -1496,14 +1538,23 @@ public:
       skip = end - maxLines;
       if (skip < 0)
         skip = 0;
+      scroll = 0;
+    }
+    if (detached && (x != detachedX || y != detachedY)) {
+      detached = false;
+      scroll = 0;
+      if (y < skip) {
+        end -= skip - y;
+        skip = y;
+      }
     }
-    if (y >= end && end < (lines.size())) {
+    if (!detached && y >= end && end < (int)lines.size()) {
       while (y >= end) {
         skip++;
         end++;
       }
 
-    } else if (y < skip && skip > 0) {
+    } else if (!detached && y < skip && skip > 0) {
       skip--;
       end--;
     }
@@ -1515,47 +1566,67 @@ public:
       return nullptr;
     this->maxWidth = maxWidth;
     int maxSupport = 0;
-    for (size_t i = skip; i < end; i++) {
-      auto s = lines[i];
-      prepare.push_back(std::pair<int, Utf8String>(s.length(), s));
+    prepareStart = skip;
+    if (!lineWrapping) {
+      prepareStart = std::max(0, skip - SCROLL_BAND);
+      end = std::min((int)lines.size(), end + 1 + SCROLL_BAND);
     }
     if (lineWrapping) {
+      for (int i = prepareStart; i < end; i++)
+        prepare.push_back({&lines[i], 0, lines[i].length()});
       return &prepare;
     }
     float neededAdvance =
-        atlas->getAdvance((&lines[y])->substr(0, useXFallback ? xSave : x));
+        atlas->advanceTo(lines[y], useXFallback ? xSave : x);
     int xOffset = 0;
     if (neededAdvance > maxWidth) {
-      auto *all = atlas->getAllAdvance(lines[y], y - skip);
-      auto len = getCurrentLineLength();
-      float acc = 0;
+      // columns starting past maxWidth * 2 up to the cursor are scrolled out
+      auto &advances = atlas->getLineAdvances(lines[y]);
+      float scale = atlas->scale;
+      size_t length = advances.length();
+      size_t first =
+          std::min(advances.columnPast(maxWidth * 2, 0, scale), length);
+      size_t cursorColumn =
+          std::min(advances.columnPast(neededAdvance, 0, scale), length);
       xSkip = 0;
-      for (auto value : *all) {
-        if (acc > neededAdvance) {
-
-          break;
-        }
-        if (acc > maxWidth * 2) {
-          xOffset++;
-          xSkip += value;
-        }
-        acc += value;
+      if (cursorColumn > first) {
+        xOffset = cursorColumn - first;
+        xSkip = (advances.at(cursorColumn) - advances.at(first)) * scale;
       }
     } else {
       xSkip = 0;
     }
-    if (xOffset > 0) {
-      for (size_t i = 0; i < prepare.size(); i++) {
-        auto a = prepare[i].second;
-        if (a.length() > xOffset)
-          prepare[i].second = a.substr(xOffset);
-        else
-          prepare[i].second = U"";
-      }
+    /*
+      Only the columns from xOffset up to the first glyph past the right
+      edge are handed out, the row starts up to a pixel left of -maxWidth.
+    */
+    float visible = (maxWidth * 2 + 1) / atlas->scale;
+    for (int i = prepareStart; i < end; i++) {
+      auto &line = lines[i];
+      auto &advances = atlas->getLineAdvances(line);
+      size_t first = std::min((size_t)xOffset, line.length());
+      size_t last = std::min(
+          advances.columnPast(advances.at(first) + visible, first),
+          advances.length());
+      last = std::min(last + 1, line.length());
+      prepare.push_back({&line, first, last});
     }
     this->xOffset = xOffset;
     return &prepare;
   }
+  /*
+    Moves the view to a line position, the fraction is kept in scroll. The
+    cursor stays where it is and the view follows it again once it moves.
+  */
+  void scrollTo(float position) {
+    float last = std::max(0, (int)lines.size() - maxLines);
+    position = std::clamp(position, 0.0f, last);
+    skip = (int)position;
+    scroll = position - skip;
+    detached = true;
+    detachedX = x;
+    detachedY = y;
+  }
   void moveLine(int diff) {
     int targetY = y + diff;
     if (targetY < 0 || targetY == lines.size())
@@ -1569,6 +1640,7 @@ public:
       lines[y + 1] = lines[y];
       lines[y] = toOffset;
     }
+    markEdited(std::min(y, targetY), std::max(y, targetY) + 1);
     y = targetY;
   }
   void calcTotalOffset() {
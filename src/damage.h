@@ -0,0 +1,450 @@
+#ifndef DAMAGE_H
+#define DAMAGE_H
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "font_atlas.h"
+#include "glad.h"
+#include "GLFW/glfw3.h"
+#include "render_cache.h"
+#include "shader.h"
+
+/*
+  Finds the rows of pixels that differ from the last frame. Rows of text
+  are compared as runs: one of the same generation at the same place as
+  last frame is skipped, one generated again, moved, drawing a glyph whose
+  metrics just changed or gone damages where it was and where it is. The
+  few other instances are compared sorted, each one found in only one of
+  the frames damages the rows it covers. Anything that moves or recolors
+  every instance, like the window size, the scroll offset or the palette
+  starting over, damages the whole window.
+*/
+class FrameDamage {
+public:
+  struct Globals {
+    // framebuffer pixels and the coordinates instances are in
+    int width = 0;
+    int height = 0;
+    float worldHeight = 0;
+    float scale = 0;
+    float scroll = 0;
+    float textBottom = 0;
+    float lineHeight = 0;
+    uint64_t layoutVersion = 0;
+    Vec4f background = {0, 0, 0, 0};
+    bool operator==(const Globals &other) const {
+      return width == other.width && height == other.height &&
+             worldHeight == other.worldHeight && scale == other.scale &&
+             scroll == other.scroll && textBottom == other.textBottom &&
+             lineHeight == other.lineHeight &&
+             layoutVersion == other.layoutVersion &&
+             memcmp(&background, &other.background, sizeof(Vec4f)) == 0;
+    }
+  };
+  static const size_t MAX_BANDS = 4;
+  // bottom and top row of each damaged band, in framebuffer pixels, sorted
+  std::vector<std::pair<int, int>> bands;
+  // the next frame is drawn completely
+  void invalidate() { valid = false; }
+  /*
+    False if the frame looks like the last one. rows are the runs placed
+    this frame, others the instances drawn besides them.
+  */
+  bool update(const Globals &globals, const std::vector<RowRun *> &rows,
+              std::initializer_list<const std::vector<RenderChar> *> others,
+              const FontAtlas &atlas) {
+    bands.clear();
+    bool full = !valid || !(globals == this->globals);
+    this->globals = globals;
+    valid = true;
+    compareRows(rows, atlas, full);
+    current.clear();
+    for (auto *list : others)
+      current.insert(current.end(), list->begin(), list->end());
+    std::sort(current.begin(), current.end(),
+              [](const RenderChar &a, const RenderChar &b) {
+                return key(a) < key(b);
+              });
+    if (full) {
+      bands.clear();
+      bands.push_back({0, globals.height});
+    } else {
+      collect(atlas);
+      merge();
+    }
+    previous.swap(current);
+    return bands.size();
+  }
+
+private:
+  // a run as drawn last frame
+  struct Row {
+    const RowRun *run;
+    uint64_t generation;
+    float y;
+    // rows its instances cover before scrolling, none if top <= bottom
+    float bottom;
+    float top;
+  };
+  // rows a glyph may reach past its quad through antialiasing
+  static const int PADDING = 2;
+  bool valid = false;
+  Globals globals;
+  std::vector<RenderChar> previous;
+  std::vector<RenderChar> current;
+  std::vector<Row> previousRows;
+  std::vector<Row> currentRows;
+  std::unordered_map<const RowRun *, size_t> lastRow;
+  std::vector<bool> matched;
+
+  static uint64_t key(const RenderChar &r) {
+    return (uint64_t)(uint16_t)r.x << 48 | (uint64_t)(uint16_t)r.y << 32 |
+           (uint64_t)r.glyph << 16 | (uint64_t)r.color << 8 | r.flags;
+  }
+  void compareRows(const std::vector<RowRun *> &rows, const FontAtlas &atlas,
+                   bool full) {
+    lastRow.clear();
+    for (size_t i = 0; i < previousRows.size(); i++)
+      lastRow[previousRows[i].run] = i;
+    matched.assign(previousRows.size(), false);
+    currentRows.clear();
+    for (auto *run : rows) {
+      Row row = {run, run->generation, run->y, 0, 0};
+      const Row *last = nullptr;
+      auto it = lastRow.find(run);
+      if (it != lastRow.end() &&
+          previousRows[it->second].generation == run->generation) {
+        last = &previousRows[it->second];
+        matched[it->second] = true;
+      }
+      if (last && !atlas.slotsChanged(run->glyphSlots())) {
+        // place moved the instances by the packed difference
+        float dy = RenderChar::pack(row.y - last->y) / RenderChar::SUBPIXELS;
+        row.bottom = last->bottom - dy;
+        row.top = last->top - dy;
+        if (dy != 0 && !full) {
+          damage(*last);
+          damage(row);
+        }
+      } else {
+        measure(row, atlas);
+        if (!full) {
+          if (last)
+            damage(*last);
+          damage(row);
+        }
+      }
+      currentRows.push_back(row);
+    }
+    for (size_t i = 0; i < previousRows.size() && !full; i++) {
+      if (!matched[i])
+        damage(previousRows[i]);
+    }
+    previousRows.swap(currentRows);
+  }
+  void measure(Row &row, const FontAtlas &atlas) const {
+    row.bottom = 0;
+    row.top = 0;
+    bool first = true;
+    for (auto &instance : row.run->instances) {
+      float bottom, top;
+      extent(instance, atlas, bottom, top);
+      if (top <= bottom)
+        continue;
+      row.bottom = first ? bottom : std::min(row.bottom, bottom);
+      row.top = first ? top : std::max(row.top, top);
+      first = false;
+    }
+  }
+  void collect(const FontAtlas &atlas) {
+    size_t a = 0, b = 0;
+    while (a < previous.size() || b < current.size()) {
+      if (b == current.size() ||
+          (a < previous.size() && key(previous[a]) < key(current[b]))) {
+        damage(previous[a++], atlas);
+      } else if (a == previous.size() || key(current[b]) < key(previous[a])) {
+        damage(current[b++], atlas);
+      } else {
+        auto &r = current[b];
+        if (!(r.flags & RenderChar::RECT) && atlas.slotChanged(r.glyph))
+          damage(r, atlas);
+        a++;
+        b++;
+      }
+    }
+  }
+  // rows an instance covers before scrolling
+  void extent(const RenderChar &r, const FontAtlas &atlas, float &bottom,
+              float &top) const {
+    bottom = r.y / RenderChar::SUBPIXELS;
+    if (r.flags & RenderChar::RECT) {
+      top = bottom +
+            (r.flags >> RenderChar::RECT_LINES_SHIFT) * globals.lineHeight;
+    } else if (const float *quad = atlas.slotMetrics(r.glyph)) {
+      // the quad hangs down from its origin, its height is negative
+      top = bottom - quad[1] * globals.scale;
+      bottom = top + quad[3] * globals.scale;
+    } else {
+      top = bottom + globals.lineHeight * 2;
+      bottom -= globals.lineHeight;
+    }
+  }
+  void damage(const RenderChar &r, const FontAtlas &atlas) {
+    float bottom, top;
+    extent(r, atlas, bottom, top);
+    damage(bottom, top, r.flags & RenderChar::SCROLLS);
+  }
+  // instances of runs scroll
+  void damage(const Row &row) { damage(row.bottom, row.top, true); }
+  void damage(float bottom, float top, bool scrolls) {
+    if (scrolls) {
+      bottom = std::max(bottom + globals.scroll, globals.textBottom);
+      top += globals.scroll;
+    }
+    if (top <= bottom || globals.worldHeight <= 0)
+      return;
+    float toPixels = globals.height / globals.worldHeight;
+    int from = (int)((bottom + globals.worldHeight / 2) * toPixels) - PADDING;
+    int to = (int)((top + globals.worldHeight / 2) * toPixels) + PADDING + 1;
+    from = std::max(from, 0);
+    to = std::min(to, globals.height);
+    if (from < to)
+      bands.push_back({from, to});
+  }
+  // joins overlapping bands and the closest ones until few are left
+  void merge() {
+    if (bands.empty())
+      return;
+    std::sort(bands.begin(), bands.end());
+    size_t out = 0;
+    for (size_t i = 1; i < bands.size(); i++) {
+      if (bands[i].first <= bands[out].second)
+        bands[out].second = std::max(bands[out].second, bands[i].second);
+      else
+        bands[++out] = bands[i];
+    }
+    bands.resize(out + 1);
+    while (bands.size() > MAX_BANDS) {
+      size_t closest = 0;
+      for (size_t i = 1; i + 1 < bands.size(); i++) {
+        if (bands[i + 1].first - bands[i].second <
+            bands[closest + 1].first - bands[closest].second)
+          closest = i;
+      }
+      bands[closest].second = bands[closest + 1].second;
+      bands.erase(bands.begin() + closest + 1);
+    }
+  }
+};
+
+/*
+  Where frames are drawn and how they get to the window. Only damaged bands
+  are drawn, so everything else has to still show the last frame. Where
+  EGL_EXT_buffer_age or GLX_EXT_buffer_age tells how many frames old the
+  back buffer is, frames go into it directly and the bands of the frames
+  it missed are drawn as well, EGL_KHR_partial_update is told which rows
+  that is. Otherwise an offscreen buffer keeps the last image. Only its
+  damaged bands are copied where the surface keeps the back buffer across
+  swaps, anything else is undefined after a swap and it's copied whole.
+  Swapping is left to GLFW, it handles the swap interval and the platform.
+*/
+class FrameTarget {
+public:
+  static const size_t MAX_AGE = 4;
+  /*
+    Binds the buffer to draw into and returns how many frames old what it
+    shows is, 0 if it's undefined and the frame is drawn completely.
+  */
+  int bind(int width, int height) {
+    if (!loaded)
+      load();
+    if (width != this->width || height != this->height)
+      history.clear();
+    this->width = width;
+    this->height = height;
+    age = 0;
+    if (queryAge) {
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      age = queryAge();
+      if (age < 0 || (size_t)age > history.size() + 1)
+        age = 0;
+      return age;
+    }
+    if (failed)
+      return 0;
+    if (width != fboWidth || height != fboHeight)
+      create(width, height);
+    if (failed)
+      return 0;
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    return age = 1;
+  }
+  // bottom and top row to draw so the buffer shows the frame damaged in bands
+  std::pair<int, int>
+  span(const std::vector<std::pair<int, int>> &bands) const {
+    if (age == 0)
+      return {0, height};
+    std::pair<int, int> out = {height, 0};
+    for (auto &band : bands)
+      out = join(out, band);
+    for (int i = 0; i + 1 < age; i++)
+      out = join(out, history[i]);
+    return out;
+  }
+  // tells EGL the rows of the back buffer drawn, before drawing them
+  void damage(std::pair<int, int> span) {
+    if (!setDamageRegion || span.second <= span.first)
+      return;
+    int32_t rect[] = {0, span.first, width, span.second - span.first};
+    setDamageRegion(currentDisplay(), currentSurface(EGL_DRAW), rect, 1);
+  }
+  // shows the frame drawn since bind, which differs from the last in bands
+  void present(GLFWwindow *window,
+               const std::vector<std::pair<int, int>> &bands) {
+    if (!queryAge && !failed) {
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+      if (preserved) {
+        for (auto &band : bands)
+          glBlitFramebuffer(0, band.first, width, band.second, 0, band.first,
+                            width, band.second, GL_COLOR_BUFFER_BIT,
+                            GL_NEAREST);
+      } else {
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+                          GL_COLOR_BUFFER_BIT, GL_NEAREST);
+      }
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    if (queryAge) {
+      std::pair<int, int> all = {height, 0};
+      for (auto &band : bands)
+        all = join(all, band);
+      history.insert(history.begin(), all);
+      if (history.size() > MAX_AGE)
+        history.pop_back();
+    }
+    glfwSwapBuffers(window);
+  }
+
+private:
+  // the few EGL and GLX entry points used, so neither header is needed
+  typedef void *(APIENTRYP EGLGetCurrentDisplay)();
+  typedef void *(APIENTRYP EGLGetCurrentSurface)(int32_t readdraw);
+  typedef unsigned(APIENTRYP EGLQuerySurface)(void *display, void *surface,
+                                              int32_t attribute,
+                                              int32_t *value);
+  typedef unsigned(APIENTRYP EGLSurfaceAttrib)(void *display, void *surface,
+                                               int32_t attribute,
+                                               int32_t value);
+  typedef unsigned(APIENTRYP EGLSetDamageRegion)(void *display, void *surface,
+                                                 int32_t *rects,
+                                                 int32_t count);
+  typedef void *(*GLXGetCurrentDisplay)();
+  typedef unsigned long (*GLXGetCurrentDrawable)();
+  typedef void (*GLXQueryDrawable)(void *display, unsigned long drawable,
+                                   int attribute, unsigned *value);
+  static constexpr int32_t EGL_DRAW = 0x3059;
+  static constexpr int32_t EGL_BUFFER_AGE = 0x313D;
+  static constexpr int32_t EGL_SWAP_BEHAVIOR = 0x3093;
+  static constexpr int32_t EGL_BUFFER_PRESERVED = 0x3094;
+  static constexpr int GLX_BACK_BUFFER_AGE = 0x20F4;
+
+  GLuint fbo = 0;
+  GLuint color = 0;
+  int width = 0;
+  int height = 0;
+  int fboWidth = 0;
+  int fboHeight = 0;
+  int age = 0;
+  bool failed = false;
+  bool loaded = false;
+  // the back buffer still shows the last frame after a swap
+  bool preserved = false;
+  // bottom and top row of what changed in each of the last frames shown
+  std::vector<std::pair<int, int>> history;
+  std::function<int()> queryAge;
+  EGLGetCurrentDisplay currentDisplay = nullptr;
+  EGLGetCurrentSurface currentSurface = nullptr;
+  EGLSetDamageRegion setDamageRegion = nullptr;
+
+  void load() {
+    loaded = true;
+    // GLFW needs EGL_KHR_create_context for the core profile asked for
+    if (glfwExtensionSupported("EGL_KHR_create_context")) {
+      currentDisplay =
+          (EGLGetCurrentDisplay)glfwGetProcAddress("eglGetCurrentDisplay");
+      currentSurface =
+          (EGLGetCurrentSurface)glfwGetProcAddress("eglGetCurrentSurface");
+      auto query = (EGLQuerySurface)glfwGetProcAddress("eglQuerySurface");
+      if (!currentDisplay || !currentSurface || !query)
+        return;
+      if (glfwExtensionSupported("EGL_EXT_buffer_age")) {
+        queryAge = [this, query]() {
+          int32_t frames = 0;
+          if (!query(currentDisplay(), currentSurface(EGL_DRAW),
+                     EGL_BUFFER_AGE, &frames))
+            return 0;
+          return (int)frames;
+        };
+        // only valid once the age was asked for in the frame
+        if (glfwExtensionSupported("EGL_KHR_partial_update"))
+          setDamageRegion = (EGLSetDamageRegion)glfwGetProcAddress(
+              "eglSetDamageRegionKHR");
+        return;
+      }
+      // fails unless the config supports it, the default is destroyed
+      auto attrib = (EGLSurfaceAttrib)glfwGetProcAddress("eglSurfaceAttrib");
+      if (attrib)
+        attrib(currentDisplay(), currentSurface(EGL_DRAW), EGL_SWAP_BEHAVIOR,
+               EGL_BUFFER_PRESERVED);
+      int32_t behavior = 0;
+      preserved = query(currentDisplay(), currentSurface(EGL_DRAW),
+                        EGL_SWAP_BEHAVIOR, &behavior) &&
+                  behavior == EGL_BUFFER_PRESERVED;
+      return;
+    }
+    if (glfwExtensionSupported("GLX_EXT_buffer_age")) {
+      auto display =
+          (GLXGetCurrentDisplay)glfwGetProcAddress("glXGetCurrentDisplay");
+      auto drawable =
+          (GLXGetCurrentDrawable)glfwGetProcAddress("glXGetCurrentDrawable");
+      auto query = (GLXQueryDrawable)glfwGetProcAddress("glXQueryDrawable");
+      if (display && drawable && query) {
+        queryAge = [display, drawable, query]() {
+          unsigned frames = 0;
+          query(display(), drawable(), GLX_BACK_BUFFER_AGE, &frames);
+          return (int)frames;
+        };
+      }
+    }
+  }
+  static std::pair<int, int> join(std::pair<int, int> a,
+                                  std::pair<int, int> b) {
+    return {std::min(a.first, b.first), std::max(a.second, b.second)};
+  }
+  void create(int width, int height) {
+    fboWidth = width;
+    fboHeight = height;
+    if (!fbo) {
+      glGenFramebuffers(1, &fbo);
+      glGenRenderbuffers(1, &color);
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, std::max(width, 1),
+                          std::max(height, 1));
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, color);
+    failed = glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+             GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+};
+
+#endif
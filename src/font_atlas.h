@@ -2,13 +2,23 @@
 #define FONT_ATLAS_H
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <filesystem>
+#include <list>
+#include <memory>
+#include <unordered_map>
 #include "base64.h"
+#include "font_fallback.h"
 #include "freetype/freetype.h"
+#include "freetype/ftadvanc.h"
 #include "freetype/fttypes.h"
 #include "shader.h"
 #include "utils.h"
 #include "glad.h"
+#include "glyph_cache.h"
+#include "glyph_rasterizer.h"
+#include "glyph_table.h"
+#include "line_advances.h"
 #include "utf8String.h"
 
 namespace fs = std::filesystem;
@@ -17,51 +27,215 @@ struct FontFace {
   bool hasColor = false;
   std::string path = "";
   FT_Face face;
+  // pixel size, or the selected strike for color bitmap fonts
+  int size = 0;
+  std::unique_ptr<GlyphCache> cache;
 };
 class FontAtlas {
 public:
-  std::map<char32_t, CharacterEntry> entries;
-  std::map<int, std::vector<float>> linesCache;
-  std::map<int, Utf8String> contentCache;
-  GLuint texture_id;
+  GlyphTable entries;
+  /*
+    Advances of lines, keyed by the line revision so zooming only changes
+    the factor they're multiplied with. An edited line is measured on top of
+    the last revision seen at the same address. Once they take more than
+    MAX_LINE_ADVANCE_BYTES the least recently used go, so revisions of
+    edited lines don't pile up.
+  */
+  struct LineAdvanceEntry {
+    uint64_t revision;
+    const Utf8String *line;
+    LineAdvances advances;
+    size_t bytes;
+  };
+  std::list<LineAdvanceEntry> lineAdvanceOrder;
+  std::unordered_map<uint64_t, std::list<LineAdvanceEntry>::iterator>
+      lineAdvances;
+  std::unordered_map<const Utf8String *, uint64_t> lineAdvanceOwners;
+  size_t lineAdvanceBytes = 0;
+  static constexpr size_t MAX_LINE_ADVANCE_BYTES = 32 << 20;
   std::vector<Utf8String> errors;
-  FT_UInt atlas_width, atlas_height, atlas_height_absolute, smallest_top,
+  // atlas_height is the line height, not the size of the texture, and like
+  // all other public metrics already multiplied by scale
+  FT_UInt atlas_height, atlas_height_absolute, smallest_top,
       atlas_height_original;
+  // all glyphs of a page live in one layer of the texture array
+  static const int ATLAS_PAGE_SIZE = 1024;
+  /*
+    Glyphs are always rasterized at this size, the distance fields stay
+    sharp when scaled so zooming only changes scale.
+  */
+  static const int REFERENCE_SIZE = 64;
+  static constexpr float MIN_FONT_SIZE = 11;
+  static constexpr float MAX_FONT_SIZE = 288;
   uint32_t fs;
   FT_Library ft;
   bool wasGenerated = false;
-  int xOffset = 0;
   uint8_t tabWidth = 2;
   float scale = 1;
+  // no GL context, glyphs are rasterized but never uploaded
+  bool headless = false;
+  // changes whenever instances returned by render() before may be outdated
+  uint64_t layoutVersion = 0;
   std::vector<FontFace *> faces;
+  // glyphs outside ASCII are rasterized here unless headless
+  std::unique_ptr<GlyphRasterizer> rasterizer;
+  // rasterized glyphs are kept here across runs, empty disables that
+  std::string cacheDir;
+  // palette of the colors passed to render(), the text shader gets it
+  ColorPalette palette;
   RenderChar render(char32_t c, float x = 0.0, float y = 0.0,
                     Vec4f color = vec4fs(1)) {
-    if (c >= 128 || c < 32)
-      lazyLoad(c);
-
-    auto *entry = &entries[c];
+    auto *entry = &glyph(c);
     RenderChar r;
-    float x2 = x + entry->left * scale;
-    float y2 = y +atlas_height;
-    y2 -= (entry->top + smallest_top * scale);
-    if (entry->hasColor) {
-      float height = entry->height * (fs / entry->height);
-      y2 += ((entry->top) - ((height) - (fs)*0.15)) * scale;
-    }
-    r.pos = vec2f(x2, -y2);
-    if (entry->hasColor) {
-      float height = entry->height * (fs / entry->height);
-      r.size = vec2f(((float)fs) * scale, (-height) * scale);
-
-    } else
-      r.size = vec2f(entry->width * scale, (-entry->height) * scale);
-    r.uv_pos = vec2f(entry->offset, 0.0f);
-    r.uv_size = vec2f(entry->width / (float)atlas_width,
-                      entry->height / atlas_height_absolute);
-    r.fg_color = color;
-    r.hasColor = entry->hasColor ? 1 : 0;
+    r.x = RenderChar::pack(x);
+    r.y = RenderChar::pack(-(y + atlas_height));
+    r.glyph = entry->slot;
+    r.color = colorIndex(color);
+    auto &pages = storeFor(*entry).pages;
+    if ((size_t)entry->page < pages.size())
+      pages[entry->page].lastUsed = frame;
     return r;
   }
+  /*
+    render() for other threads, only reads. False if c or color isn't loaded
+    yet. The page of the glyph is kept by touchSlot once the row is placed.
+  */
+  bool renderKnown(char32_t c, float x, float y, Vec4f color, RenderChar &out,
+                   float &advance) {
+    auto *entry = entries.find(c);
+    int index = palette.find(color);
+    if (!entry || index == -1)
+      return false;
+    out.x = RenderChar::pack(x);
+    out.y = RenderChar::pack(-(y + atlas_height));
+    out.glyph = entry->slot;
+    out.color = index;
+    out.flags = 0;
+    advance = entry->advance * scale;
+    return true;
+  }
+  // loads color into the palette, so renderKnown finds it
+  void loadColor(Vec4f color) { colorIndex(color); }
+  /*
+    Solid box instances drawn along with the glyphs, pos is a corner and
+    size may be negative. Heights are whole lines of atlas_height, taller
+    boxes take one instance per MAX_RECT_LINES. Boxes are cut to the range
+    positions can be packed in.
+  */
+  void renderRect(std::vector<RenderChar> &out, Vec2f pos, Vec2f size,
+                  Vec4f color, uint8_t flags = RenderChar::SCROLLS) {
+    if (size.x < 0) {
+      pos.x += size.x;
+      size.x = -size.x;
+    }
+    if (size.y < 0) {
+      pos.y += size.y;
+      size.y = -size.y;
+    }
+    if (pos.x < -RenderChar::MAX_POSITION) {
+      size.x -= -RenderChar::MAX_POSITION - pos.x;
+      pos.x = -RenderChar::MAX_POSITION;
+    }
+    size.x = std::min(size.x, RenderChar::MAX_POSITION - pos.x);
+    if (size.x <= 0)
+      return;
+    int lines =
+        atlas_height > 0 ? (int)std::lround(size.y / atlas_height) : 0;
+    RenderChar r;
+    r.x = RenderChar::pack(pos.x);
+    r.glyph = (uint16_t)std::min(size.x * RenderChar::SUBPIXELS, 65535.0f);
+    r.color = colorIndex(color);
+    while (lines > 0) {
+      int chunk = std::min(lines, RenderChar::MAX_RECT_LINES);
+      r.y = RenderChar::pack(pos.y);
+      r.flags = flags | RenderChar::RECT |
+                (chunk << RenderChar::RECT_LINES_SHIFT);
+      if (RenderChar::fits(pos.y))
+        out.push_back(r);
+      pos.y += chunk * atlas_height;
+      lines -= chunk;
+    }
+  }
+  // instances kept from an earlier frame still draw from their page
+  void touchSlot(uint16_t slot) {
+    if (slot >= slotPages.size())
+      return;
+    uint32_t page = slotPages[slot];
+    auto &pages = (page & 1 ? color : mono).pages;
+    if ((page >> 1) < pages.size())
+      pages[page >> 1].lastUsed = frame;
+  }
+  // SDF glyphs are sampled from unit 0, color glyphs from unit 1
+  void bindTextures() {
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_BUFFER, metricsTexture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, color.texture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, mono.texture);
+  }
+  // also uploads the glyphs the workers finished since the last frame
+  void beginFrame() {
+    frame++;
+    evictedVisible = false;
+    if (!rasterizer)
+      return;
+    for (auto &result : rasterizer->takeResults())
+      finishGlyph(result);
+  }
+  /*
+    Uploads the metrics of glyphs added since the last call into the buffer
+    texture on unit 2, before drawing instances that may refer to them.
+  */
+  void flushMetrics() {
+    flushedBegin = dirtyBegin;
+    flushedEnd = dirtyEnd;
+    if (headless || dirtyEnd <= dirtyBegin)
+      return;
+    if (!metricsTexture) {
+      glGenBuffers(1, &metricsBuffer);
+      glGenTextures(1, &metricsTexture);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, metricsBuffer);
+    if (metricsCapacity < slotPages.size()) {
+      metricsCapacity = MAX_GLYPH_SLOTS;
+      if (metricsCapacity > slotPages.size() * 2)
+        metricsCapacity = slotPages.size() * 2;
+      glBufferData(GL_TEXTURE_BUFFER,
+                   sizeof(float) * METRIC_FLOATS * metricsCapacity, nullptr,
+                   GL_DYNAMIC_DRAW);
+      dirtyBegin = 0;
+      dirtyEnd = slotPages.size();
+    }
+    glBufferSubData(GL_TEXTURE_BUFFER,
+                    sizeof(float) * METRIC_FLOATS * dirtyBegin,
+                    sizeof(float) * METRIC_FLOATS * (dirtyEnd - dirtyBegin),
+                    &metrics[METRIC_FLOATS * dirtyBegin]);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_BUFFER, metricsTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, metricsBuffer);
+    glActiveTexture(GL_TEXTURE0);
+    dirtyBegin = dirtyEnd = 0;
+  }
+  // quad offset and size of a slot, unscaled, nullptr for unknown slots
+  const float *slotMetrics(uint16_t slot) const {
+    if (slot >= slotPages.size())
+      return nullptr;
+    return &metrics[slot * METRIC_FLOATS];
+  }
+  // whether the last flushMetrics changed what slot draws
+  bool slotChanged(uint16_t slot) const {
+    return slot >= flushedBegin && slot < flushedEnd;
+  }
+  // like slotChanged for any of slots, which are sorted
+  bool slotsChanged(const std::vector<uint16_t> &slots) const {
+    auto it = std::lower_bound(slots.begin(), slots.end(), flushedBegin);
+    return it != slots.end() && *it < flushedEnd;
+  }
+  bool glyphsReady() { return rasterizer && rasterizer->hasResults(); }
+  // a page with glyphs of the current frame was evicted, draw the frame again
+  bool needsRedraw() { return evictedVisible; }
   float getColonWidth() {
     return fs * scale;
   }
@@ -69,24 +243,30 @@ public:
     if(entries.count(U'\t'))
       return;
     CharacterEntry entry;
-    entry.advance = entries[U' '].advance * tabWidth;
+    entry.c = U'\t';
+    entry.advance = glyph(U' ').advance * tabWidth;
     entry.hasColor = false;
     entry.width = 0;
     entry.height = 0;
-    entries[U'\t'] = entry;
+    layoutGlyph(entry);
+    insertGlyph(entry);
   }
   float getAdvance(char32_t c) {
-    if(c >= 128 || c<32)
-      lazyLoad(c);
-   return entries[c].advance * scale; 
+   return glyph(c).advance * scale; 
  }
-  FontAtlas(std::string path, uint32_t fontSize) {
+  FontAtlas(std::string path, uint32_t fontSize, bool headless = false,
+            std::string cacheDir = "") {
+    this->headless = headless;
+    this->cacheDir = cacheDir;
     errors.clear();
+    if (!headless)
+      rasterizer = std::make_unique<GlyphRasterizer>();
     if (FT_Init_FreeType(&ft)) {
       std::cout << "ERROR::FREETYPE: Could not init FreeType Library"
                 << std::endl;
       return;
     }
+    configureSdf(ft);
     readFont(path, fontSize, true);
   }
   size_t fontSelectSize(uint32_t size, FT_Face face) {
@@ -99,9 +279,21 @@ public:
     }
     return i;
   }
+  void setFaceSize(FontFace *face, uint32_t size) {
+    if (face->hasColor) {
+      face->size = fontSelectSize(size, face->face);
+      FT_Select_Size(face->face, face->size);
+    } else {
+      face->size = size;
+      FT_Set_Pixel_Sizes(face->face, 0, size);
+    }
+  }
   void readFont(std::string path, uint32_t fontSize,
                 bool shouldRender = false) {
+    // configured fonts take priority over the fallbacks found so far
+    faceMemo.clear();
     if (wasGenerated && shouldRender) {
+      saveGlyphCaches();
       for (auto *entry : faces) {
         FT_Done_Face(entry->face);
         delete entry;
@@ -137,10 +329,7 @@ public:
           }
           face->path = path;
           face->hasColor = isColorEmojiFont(face->face);
-          if (face->hasColor)
-            FT_Select_Size(face->face, fontSelectSize(fontSize, face->face));
-          else
-            FT_Set_Pixel_Sizes(face->face, 0, fontSize);
+          setFaceSize(face, REFERENCE_SIZE);
           faces.push_back(face);
         }
         FT_Done_Face(gFace);
@@ -155,130 +344,93 @@ public:
     }
     face->path = path;
     face->hasColor = isColorEmojiFont(face->face);
-    if (face->hasColor)
-      FT_Select_Size(face->face, fontSelectSize(fontSize, face->face));
-    else
-      FT_Set_Pixel_Sizes(face->face, 0, fontSize);
+    setFaceSize(face, REFERENCE_SIZE);
     faces.push_back(face);
-    if (shouldRender)
-      renderFont(fontSize, face);
-  }
-  void resizeFonts(uint32_t size) {
-    for (auto &face : faces) {
-      if (face->hasColor)
-        FT_Select_Size(face->face, 0);
-      else
-        FT_Set_Pixel_Sizes(face->face, 0, size);
+    if (shouldRender) {
+      scale = (float)fontSize / REFERENCE_SIZE;
+      renderFont(REFERENCE_SIZE, face);
     }
-    fs = size;
   }
-  void changeScale(float diff) {
-
-    if (scale + diff > 1.8 || scale + diff < 0.6) {
-      if ((fs == 18 && scale + diff < 0.6) ||
-          (fs == 160 && scale + diff > 1.8)) {
-        return;
-      }
-
-      entries.clear();
-      auto newSize = scale + diff > 1.8 ? fs * 1.8 : fs * 0.8;
-      scale = 1;
-      if (newSize < 18)
-        newSize = 18;
-      else if (newSize > 160)
-        newSize = 160;
-      for (auto &face : faces) {
-        if (face->hasColor)
-          FT_Select_Size(face->face, fontSelectSize(newSize, face->face));
-        else
-          FT_Set_Pixel_Sizes(face->face, 0, newSize);
-      }
-      renderFont(newSize, faces[0]);
-    } else {
-      scale += diff;
-      atlas_height = atlas_height_original * scale;
-    }
+  void resizeFonts(uint32_t size) { setScale((float)size / fs); }
+  // metrics only, the atlas is reused at every size
+  void changeScale(float diff) { setScale(scale * (1 + diff)); }
+  void setScale(float value) {
+    if (fs * value < MIN_FONT_SIZE)
+      value = MIN_FONT_SIZE / fs;
+    else if (fs * value > MAX_FONT_SIZE)
+      value = MAX_FONT_SIZE / fs;
+    scale = value;
+    atlas_height = atlas_height_original * scale;
+    layoutVersion++;
   }
   void renderFont(uint32_t fontSize, FontFace *faceEntry) {
-    if (wasGenerated) {
-      glDeleteTextures(1, &texture_id);
-      linesCache.clear();
-    }
+    clearLineAdvances();
+    layoutVersion++;
+    entries.clear();
+    resetSlots();
+    generation++;
+    if (rasterizer)
+      rasterizer->cancel();
     auto &face = faceEntry->face;
     fs = fontSize;
-    atlas_width = 0;
     atlas_height = 0;
     smallest_top = 1e9;
-    // TODO should this be here?
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    resetAtlas();
+    auto *cache = cacheFor(faceEntry);
+    std::vector<CharacterEntry> batch;
     for (int i = 32; i < 128; i++) {
-      if (FT_Load_Char(face, i,
-                       FT_LOAD_RENDER | FT_LOAD_TARGET_(FT_RENDER_MODE_SDF))) {
-        std::cout << "Failed to load char: " << (char)i << "\n";
-        return;
-      }
-      auto bm = face->glyph->bitmap;
-      atlas_width += bm.width;
-      atlas_height = bm.rows > atlas_height ? bm.rows : atlas_height;
-
       CharacterEntry entry;
-      entry.width = bm.width;
-      entry.height = bm.rows;
-      entry.top = face->glyph->bitmap_top;
-      entry.left = face->glyph->bitmap_left;
-      entry.advance = face->glyph->advance.x >> 6;
-      entry.advanceY = face->glyph->advance.y >> 6;
-      entry.hasColor = faceEntry->hasColor;
-      entry.c = (char32_t)i;
-      entry.data = new uint8_t[(int)entry.width * (int)entry.height * 4];
-      for (size_t i = 0; i < (entry.width * entry.height); i++) {
-        auto target_index = i * 4;
-        entry.data[target_index] = face->glyph->bitmap.buffer[i];
-        entry.data[target_index + 1] = face->glyph->bitmap.buffer[i];
-        entry.data[target_index + 2] = face->glyph->bitmap.buffer[i];
-        entry.data[target_index + 3] = 255;
+      if (!cache || !cache->find(i, entry)) {
+        if (FT_Load_Char(face, i,
+                         FT_LOAD_RENDER |
+                             FT_LOAD_TARGET_(FT_RENDER_MODE_SDF))) {
+          std::cout << "Failed to load char: " << (char)i << "\n";
+          return;
+        }
+        auto bm = face->glyph->bitmap;
+        entry.width = bm.width;
+        entry.height = bm.rows;
+        entry.top = face->glyph->bitmap_top;
+        entry.left = face->glyph->bitmap_left;
+        entry.advance = face->glyph->advance.x >> 6;
+        entry.advanceY = face->glyph->advance.y >> 6;
+        entry.hasColor = faceEntry->hasColor;
+        entry.c = (char32_t)i;
+        entry.data = new uint8_t[(int)entry.width * (int)entry.height];
+        if (bm.buffer)
+          memcpy(entry.data, bm.buffer, (int)entry.width * (int)entry.height);
+        if (cache)
+          cache->add(entry);
       }
+      atlas_height =
+          entry.height > atlas_height ? (FT_UInt)entry.height : atlas_height;
       if (smallest_top == 0 && entry.top > 0)
         smallest_top = entry.top;
       else
         smallest_top = entry.top < smallest_top && entry.top != 0
                            ? entry.top
                            : smallest_top;
-      entries.insert(std::pair<char32_t, CharacterEntry>(entry.c, entry));
+      if (!place(entry)) {
+        errors.push_back(U"Glyph atlas is full");
+        return;
+      }
+      batch.push_back(entry);
     }
-    atlas_width *= 2;
+    uploadFreshPages(batch);
+    for (auto &entry : batch)
+      insertGlyph(entry);
+    saveGlyphCaches();
+    // render() doesn't lazy load ASCII, keep those pages resident
+    for (auto *store : {&mono, &color})
+      for (auto &page : store->pages)
+        page.pinned = true;
     atlas_height_absolute = atlas_height;
     atlas_height_original = atlas_height;
     atlas_height *= scale;
-
-    // texture
-    glActiveTexture(GL_TEXTURE0);
-    glGenTextures(1, &texture_id);
-    glBindTexture(GL_TEXTURE_2D, texture_id);
-
-    // params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, (GLsizei)atlas_width,
-                 (GLsizei)atlas_height_absolute, 0, GL_RGBA, GL_UNSIGNED_BYTE,
-                 nullptr);
-    xOffset = 0;
-    for (int i = 32; i < 128; i++) {
-      CharacterEntry &entry = entries[i];
-      entry.offset = (float)xOffset / (float)atlas_width;
-      entry.xPos = xOffset;
-
-      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-      glTexSubImage2D(GL_TEXTURE_2D, 0, xOffset, 0, entry.width, entry.height,
-                      GL_RGBA, GL_UNSIGNED_BYTE, entry.data);
-
-      xOffset += entry.width;
-    }
+    entries.forEach([this](CharacterEntry &entry) {
+      layoutGlyph(entry);
+      writeMetrics(entry);
+    });
     wasGenerated = true;
   }
   void lazyLoad(char32_t c) {
@@ -288,113 +440,49 @@ public:
       ensureTab();
       return;
     }
-    FontFace *faceEntry = nullptr;
-    for (auto *e : faces) {
-      uint32_t glyph_index = FT_Get_Char_Index(e->face, c);
-      if (glyph_index != 0) {
-        faceEntry = e;
-        break;
+    const bool known = faceMemo.get(c) != CodepointMemo::UNKNOWN;
+    FontFace *faceEntry = faceFor(c);
+    if (!faceEntry) {
+      if (!known) {
+        Utf8String errStr = U"No font file for char ";
+        errStr += std::to_string((int)c);
+        errors.push_back(errStr);
       }
+      markMissing(c);
+      return;
     }
-    if (!faceEntry) {
-      Utf8String errStr = U"No font file for char ";
-      errStr += std::to_string((int)c);
-      errors.push_back(errStr);
+    CharacterEntry entry;
+    auto *cache = cacheFor(faceEntry);
+    if (cache && cache->find(c, entry)) {
+      addGlyph(entry);
       return;
     }
-    auto &face = faceEntry->face;
-    auto f = FT_LOAD_RENDER;
-    if (faceEntry->hasColor)
-      f |= FT_LOAD_COLOR;
-    else
-      f |= FT_LOAD_TARGET_(FT_RENDER_MODE_SDF);
-    FT_Error err = FT_Load_Char(face, c, f);
-    if (err) {
+    if (rasterizer) {
+      queueGlyph(c, faceEntry);
+      return;
+    }
+    if (!rasterizeGlyph(faceEntry->face, c, faceEntry->hasColor, entry)) {
       Utf8String errStr = U"No font file for char ";
       errStr += c;
       errors.push_back(errStr);
+      markMissing(c);
       return;
     }
-    CharacterEntry entry;
-    auto bm = face->glyph->bitmap;
-    entry.width = bm.width;
-    entry.height = bm.rows;
-    entry.top = face->glyph->bitmap_top;
-    entry.left = face->glyph->bitmap_left;
-    entry.advance = face->glyph->advance.x >> 6;
-    entry.xPos = xOffset;
-    entry.hasColor = faceEntry->hasColor;
-    if (entry.hasColor)
-      entry.advance = fs;
-    auto old_width = atlas_width;
-    auto old_height = atlas_height;
-    atlas_width += bm.width;
-    atlas_height_absolute =
-        bm.rows > atlas_height_absolute ? bm.rows : atlas_height_absolute;
-    if (!entry.hasColor) {
-      atlas_height = atlas_height_absolute;
-      atlas_height_original = atlas_height;
-      atlas_height *= scale;
-    }
-    entry.offset = (float)xOffset / (float)atlas_width;
-    GLuint new_tex_id;
-    glGenTextures(1, &new_tex_id);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, new_tex_id);
-    // params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, (GLsizei)atlas_width,
-                 (GLsizei)atlas_height_absolute, 0, GL_RGBA, GL_UNSIGNED_BYTE,
-                 nullptr);
-
-    for (std::map<char32_t, CharacterEntry>::iterator it = entries.begin();
-         it != entries.end(); ++it) {
-      it->second.offset = (float)it->second.xPos / (float)atlas_width;
-      glTexSubImage2D(GL_TEXTURE_2D, 0, it->second.xPos, 0, it->second.width,
-                      it->second.height, GL_RGBA, GL_UNSIGNED_BYTE,
-                      it->second.data);
-    }
-    (&entry)->data = new uint8_t[(int)entry.width * (int)entry.height * 4];
-    if (entry.hasColor) {
-      for (size_t i = 0; i < ((int)entry.width * (int)entry.height) * 4;
-           i += 4) {
-        entry.data[i + 2] = face->glyph->bitmap.buffer[i];
-        entry.data[i + 1] = face->glyph->bitmap.buffer[i + 1];
-        entry.data[i] = face->glyph->bitmap.buffer[i + 2];
-        entry.data[i + 3] = face->glyph->bitmap.buffer[i + 3];
-      }
-    } else {
-      for (size_t i = 0; i < (entry.width * entry.height); i++) {
-        auto target_index = i * 4;
-        entry.data[target_index] = face->glyph->bitmap.buffer[i];
-        entry.data[target_index + 1] = face->glyph->bitmap.buffer[i];
-        entry.data[target_index + 2] = face->glyph->bitmap.buffer[i];
-        entry.data[target_index + 3] = 255;
-      }
+    if (cache)
+      cache->add(entry);
+    addGlyph(entry);
+  }
+  void saveGlyphCaches() {
+    for (auto *face : faces) {
+      if (face->cache)
+        face->cache->save();
     }
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, xOffset, 0, entry.width, entry.height,
-                    GL_RGBA, GL_UNSIGNED_BYTE, entry.data);
-    glDeleteTextures(1, &texture_id);
-    texture_id = new_tex_id;
-    entry.c = (char32_t)c;
-    xOffset += entry.width;
-    entries.insert(std::pair<char32_t, CharacterEntry>(entry.c, entry));
   }
   float getAdvance(Utf8String line) {
     float v = 0;
     auto vec = line.getCodePoints();
-    for (auto c : vec) {
-      if (c >= 128 || c < 32)
-        lazyLoad(c);
-      v += entries[c].advance * scale;
-    }
+    for (auto c : vec)
+      v += glyph(c).advance * scale;
     return v;
   }
   float getAdvance(std::string line) {
@@ -402,31 +490,527 @@ public:
     std::string::const_iterator c;
     for (c = line.begin(); c != line.end(); c++) {
       char32_t cc = (char32_t)(*c);
-      v += entries[cc].advance * scale;
+      v += glyph(cc).advance * scale;
     }
     return v;
   }
 
-  std::vector<float> *getAllAdvance(Utf8String& line, int y) {
-    if (linesCache.count(y)) {
-      if (contentCache[y] == line) {
-        return &linesCache[y];
+  const LineAdvances &getLineAdvances(const Utf8String &line) {
+    auto found = lineAdvances.find(line.getRevision());
+    if (found != lineAdvances.end()) {
+      lineAdvanceOrder.splice(lineAdvanceOrder.begin(), lineAdvanceOrder,
+                              found->second);
+      return found->second->advances;
+    }
+    const LineAdvances *previous = nullptr;
+    auto owner = lineAdvanceOwners.find(&line);
+    if (owner != lineAdvanceOwners.end()) {
+      auto last = lineAdvances.find(owner->second);
+      if (last != lineAdvances.end())
+        previous = &last->second->advances;
+    }
+    LineAdvances advances;
+    advances.build(line, previous,
+                   [this](char32_t c) { return glyph(c).advance; });
+    // a line of one chunk is measured again as a whole anyway
+    if (!advances.pieces.empty())
+      lineAdvanceOwners[&line] = line.getRevision();
+    size_t bytes = advances.size() + 128;
+    lineAdvanceBytes += bytes;
+    lineAdvanceOrder.push_front(
+        {line.getRevision(), &line, std::move(advances), bytes});
+    lineAdvances[line.getRevision()] = lineAdvanceOrder.begin();
+    // the entry just made always stays, even if it alone is over budget
+    while (lineAdvanceBytes > MAX_LINE_ADVANCE_BYTES &&
+           lineAdvanceOrder.size() > 1) {
+      auto &last = lineAdvanceOrder.back();
+      lineAdvanceBytes -= last.bytes;
+      lineAdvances.erase(last.revision);
+      auto owner = lineAdvanceOwners.find(last.line);
+      if (owner != lineAdvanceOwners.end() && owner->second == last.revision)
+        lineAdvanceOwners.erase(owner);
+      lineAdvanceOrder.pop_back();
+    }
+    return lineAdvanceOrder.front().advances;
+  }
+  void clearLineAdvances() {
+    lineAdvances.clear();
+    lineAdvanceOrder.clear();
+    lineAdvanceOwners.clear();
+    lineAdvanceBytes = 0;
+  }
+  // width of the first column codepoints of line
+  float advanceTo(const Utf8String &line, size_t column) {
+    return getLineAdvances(line).at(column) * scale;
+  }
+  float advanceBetween(const Utf8String &line, size_t from, size_t to) {
+    if (to <= from)
+      return 0;
+    auto &advances = getLineAdvances(line);
+    return (advances.at(to) - advances.at(from)) * scale;
+  }
+  // number of codepoints that fit completely within x
+  size_t columnAt(const Utf8String &line, float x) {
+    return getLineAdvances(line).columnPast(x, 1, scale) - 1;
+  }
+  bool isColorEmojiFont(FT_Face &face) { return FT_HAS_COLOR(face); }
+  CharacterEntry &glyph(char32_t c) {
+    auto *entry = entries.find(c);
+    if (!entry) {
+      lazyLoad(c);
+      entry = entries.find(c);
+    }
+    return *entry;
+  }
+
+private:
+  /*
+    Glyphs are packed into shelves, rows as high as the first glyph placed
+    in them, on fixed size pages. Pages are layers of one texture array
+    which grows until the memory budget is reached, after that the least
+    recently drawn page is cleared and reused.
+    SDF glyphs only need one channel and live in an R8 array, color glyphs
+    get their own RGBA array which is only created once one is loaded.
+  */
+  struct AtlasShelf {
+    int y;
+    int height;
+    int x;
+  };
+  struct AtlasPage {
+    std::vector<AtlasShelf> shelves;
+    int shelfTop = 0;
+    uint64_t lastUsed = 0;
+    bool pinned = false;
+    std::vector<char32_t> glyphs;
+  };
+  struct AtlasStore {
+    AtlasStore(GLenum internalFormat, GLenum format, size_t bytesPerPixel)
+        : internalFormat(internalFormat), format(format),
+          bytesPerPixel(bytesPerPixel) {}
+    GLenum internalFormat;
+    GLenum format;
+    size_t bytesPerPixel;
+    GLuint texture = 0;
+    std::vector<AtlasPage> pages;
+    size_t layerCapacity = 0;
+    size_t maxPages = 0;
+  };
+  static const int ATLAS_PADDING = 1;
+  // per store, so color emoji can't push text glyphs out and vice versa
+  static const size_t ATLAS_MEMORY_BUDGET = 32 * 1024 * 1024;
+  AtlasStore mono{GL_R8, GL_RED, 1};
+  AtlasStore color{GL_RGBA8, GL_RGBA, 4};
+  uint64_t frame = 1;
+  bool evictedVisible = false;
+  /*
+    Glyph metrics for the shader, three RGBA32F texels per slot: quad offset
+    and size, UV rect, page and color flag. Slot 0 stays empty, 65536 texels
+    is the smallest buffer texture GL 3.3 guarantees.
+  */
+  static const size_t METRIC_FLOATS = 12;
+  static const size_t MAX_GLYPH_SLOTS = 65536 / 3;
+  std::vector<float> metrics;
+  // page << 1 | hasColor per slot
+  std::vector<uint32_t> slotPages;
+  std::vector<uint16_t> freeSlots;
+  size_t dirtyBegin = 0, dirtyEnd = 0;
+  size_t flushedBegin = 0, flushedEnd = 0;
+  size_t metricsCapacity = 0;
+  GLuint metricsBuffer = 0, metricsTexture = 0;
+
+  uint64_t generation = 0;
+
+  int colorIndex(Vec4f color) {
+    int index = palette.index(color);
+    if (index != -1)
+      return index;
+    // a full palette starts over, instances made before must be made again
+    palette.clear();
+    layoutVersion++;
+    evictedVisible = true;
+    return palette.index(color);
+  }
+  void resetSlots() {
+    metrics.assign(METRIC_FLOATS, 0);
+    slotPages.assign(1, 0);
+    freeSlots.clear();
+    dirtyBegin = 0;
+    dirtyEnd = 1;
+  }
+  // a glyph replacing an earlier entry keeps its slot, so instances made
+  // with a placeholder show the rasterized glyph once it arrives
+  void insertGlyph(CharacterEntry &entry, bool needsSlot = true) {
+    auto *existing = entries.find(entry.c);
+    if (existing && existing->slot)
+      entry.slot = existing->slot;
+    else if (!needsSlot)
+      entry.slot = 0;
+    else if (freeSlots.size()) {
+      entry.slot = freeSlots.back();
+      freeSlots.pop_back();
+    } else if (slotPages.size() < MAX_GLYPH_SLOTS) {
+      entry.slot = slotPages.size();
+      slotPages.push_back(0);
+      metrics.resize(metrics.size() + METRIC_FLOATS);
+    } else {
+      entry.slot = 0;
+    }
+    writeMetrics(entry);
+    entries.insert(entry);
+  }
+  void writeMetrics(const CharacterEntry &entry) {
+    if (!entry.slot)
+      return;
+    float *out = &metrics[entry.slot * METRIC_FLOATS];
+    const float values[METRIC_FLOATS] = {
+        entry.quadOffset.x, entry.quadOffset.y, entry.quadSize.x,
+        entry.quadSize.y,   entry.uvPos.x,      entry.uvPos.y,
+        entry.uvSize.x,     entry.uvSize.y,     (float)entry.page,
+        entry.hasColor ? 1.0f : 0.0f, 0, 0};
+    memcpy(out, values, sizeof(values));
+    slotPages[entry.slot] = ((uint32_t)entry.page << 1) | entry.hasColor;
+    if (dirtyBegin == dirtyEnd) {
+      dirtyBegin = entry.slot;
+      dirtyEnd = entry.slot + 1;
+    } else {
+      dirtyBegin = std::min(dirtyBegin, (size_t)entry.slot);
+      dirtyEnd = std::max(dirtyEnd, (size_t)entry.slot + 1);
+    }
+  }
+
+  /*
+    Until the worker is done the glyph is an empty placeholder with the
+    final advance, so the line layout doesn't move once it arrives.
+  */
+  void queueGlyph(char32_t c, FontFace *faceEntry) {
+    CharacterEntry entry;
+    entry.c = c;
+    if (faceEntry->hasColor) {
+      entry.advance = fs;
+    } else {
+      FT_Fixed advance = 0;
+      FT_Get_Advance(faceEntry->face, FT_Get_Char_Index(faceEntry->face, c),
+                     FT_LOAD_TARGET_(FT_RENDER_MODE_SDF), &advance);
+      entry.advance = advance >> 16;
+    }
+    layoutGlyph(entry);
+    insertGlyph(entry);
+    rasterizer->request({c, faceEntry->path, faceEntry->face->face_index,
+                         faceEntry->hasColor, faceEntry->size, generation});
+  }
+  void finishGlyph(GlyphResult &result) {
+    if (result.job.generation != generation)
+      return;
+    auto *placeholder = entries.find(result.job.c);
+    if (!placeholder)
+      return;
+    if (!result.ok) {
+      Utf8String errStr = U"No font file for char ";
+      errStr += result.job.c;
+      errors.push_back(errStr);
+      return;
+    }
+    result.entry.advance = placeholder->advance;
+    for (auto *face : faces) {
+      if (face->path == result.job.path &&
+          face->face->face_index == result.job.faceIndex) {
+        if (auto *cache = cacheFor(face))
+          cache->add(result.entry);
+        break;
       }
     }
-    std::vector<float> values;
-    auto vec = line.getCodePoints();
-    Utf8String::const_iterator c;
-    for (const auto c : vec) {
-      if (c >= 128 || c < 32)
-        lazyLoad(c);
+    addGlyph(result.entry);
+  }
+  void addGlyph(CharacterEntry &entry) {
+    if (entry.hasColor)
+      entry.advance = fs;
+    atlas_height_absolute = entry.height > atlas_height_absolute
+                                ? entry.height
+                                : atlas_height_absolute;
+    if (!entry.hasColor) {
+      atlas_height = atlas_height_absolute;
+      atlas_height_original = atlas_height;
+      atlas_height *= scale;
+    }
+    if (!place(entry)) {
+      errors.push_back(U"Glyph atlas is full");
+      markMissing(entry.c);
+      return;
+    }
+    upload(entry);
+    layoutGlyph(entry);
+    insertGlyph(entry);
+  }
+  std::map<std::string, uint64_t> fontKeys;
+  // index into faces for every codepoint looked up so far
+  CodepointMemo faceMemo;
+  FontFallback fallback;
 
-      values.push_back(entries[c].advance * scale);
+  FontFace *faceFor(char32_t c) {
+    int16_t id = faceMemo.get(c);
+    if (id == CodepointMemo::UNKNOWN) {
+      id = findFace(c);
+      faceMemo.set(c, id);
     }
-    linesCache[y] = values;
-    contentCache[y] = line;
-    return &linesCache[y];
+    return id < 0 ? nullptr : faces[id];
+  }
+  int16_t findFace(char32_t c) {
+    for (size_t i = 0; i < faces.size(); i++) {
+      if (FT_Get_Char_Index(faces[i]->face, c))
+        return i;
+    }
+    std::string path;
+    int index;
+    if (faces.empty() || !faces[0]->face->family_name ||
+        !fallback.resolve(c, faces[0]->face->family_name, path, index))
+      return CodepointMemo::NONE;
+    for (size_t i = 0; i < faces.size(); i++) {
+      // already loaded and it doesn't map c after all
+      if (faces[i]->path == path && faces[i]->face->face_index == index)
+        return CodepointMemo::NONE;
+    }
+    FontFace *face = new FontFace();
+    if (FT_New_Face(ft, path.c_str(), index, &face->face)) {
+      delete face;
+      return CodepointMemo::NONE;
+    }
+    face->path = path;
+    face->hasColor = isColorEmojiFont(face->face);
+    setFaceSize(face, REFERENCE_SIZE);
+    faces.push_back(face);
+    if (!FT_Get_Char_Index(face->face, c))
+      return CodepointMemo::NONE;
+    return faces.size() - 1;
+  }
+
+  GlyphCache *cacheFor(FontFace *face) {
+    if (cacheDir.empty())
+      return nullptr;
+    if (!face->cache)
+      face->cache = std::make_unique<GlyphCache>();
+    auto &cache = *face->cache;
+    if (cache.size != face->size) {
+      cache.save();
+      if (!fontKeys.count(face->path))
+        fontKeys[face->path] = GlyphCache::fontKey(face->path);
+      cache.open(GlyphCache::fileName(cacheDir, fontKeys[face->path],
+                                      face->face->face_index, face->size),
+                 face->size);
+    }
+    return &cache;
+  }
+  /*
+    Right after resetAtlas() the pages are empty, so every page goes up in
+    one call covering its used rows instead of one call per glyph.
+  */
+  void uploadFreshPages(std::vector<CharacterEntry> &batch) {
+    for (auto *store : {&mono, &color}) {
+      if (headless)
+        break;
+      const size_t bpp = store->bytesPerPixel;
+      for (size_t p = 0; p < store->pages.size(); p++) {
+        const int rows = store->pages[p].shelfTop;
+        if (!rows)
+          continue;
+        std::vector<uint8_t> pixels((size_t)ATLAS_PAGE_SIZE * rows * bpp);
+        for (auto &entry : batch) {
+          if (&storeFor(entry) != store || entry.page != (int)p ||
+              !entry.data)
+            continue;
+          const size_t rowBytes = (size_t)entry.width * bpp;
+          for (int y = 0; y < (int)entry.height; y++)
+            memcpy(&pixels[((size_t)(entry.yPos + y) * ATLAS_PAGE_SIZE +
+                            entry.xPos) *
+                           bpp],
+                   entry.data + y * rowBytes, rowBytes);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, store->texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, (GLint)p,
+                        ATLAS_PAGE_SIZE, rows, 1, store->format,
+                        GL_UNSIGNED_BYTE, pixels.data());
+      }
+    }
+    for (auto &entry : batch) {
+      delete[] entry.data;
+      entry.data = nullptr;
+    }
+  }
+  // remembered as an empty glyph so the lookup isn't retried every frame
+  void markMissing(char32_t c) {
+    CharacterEntry entry;
+    entry.c = c;
+    insertGlyph(entry, false);
+  }
+  void layoutGlyph(CharacterEntry &entry) {
+    float offsetY = -(entry.top + smallest_top);
+    if (entry.hasColor) {
+      float height = entry.height * (fs / entry.height);
+      offsetY += (entry.top) - ((height) - (fs)*0.15);
+      entry.quadSize = vec2f((float)fs, -height);
+    } else
+      entry.quadSize = vec2f(entry.width, -entry.height);
+    entry.quadOffset = vec2f(entry.left, offsetY);
+    entry.uvPos = vec2f(entry.xPos / (float)ATLAS_PAGE_SIZE,
+                        entry.yPos / (float)ATLAS_PAGE_SIZE);
+    entry.uvSize = vec2f(entry.width / (float)ATLAS_PAGE_SIZE,
+                         entry.height / (float)ATLAS_PAGE_SIZE);
+  }
+  AtlasStore &storeFor(const CharacterEntry &entry) {
+    return entry.hasColor ? color : mono;
+  }
+  GLuint createTexture(AtlasStore &store, size_t layers) {
+    GLuint id;
+    glGenTextures(1, &id);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, store.internalFormat, ATLAS_PAGE_SIZE,
+                 ATLAS_PAGE_SIZE, (GLsizei)layers, 0, store.format,
+                 GL_UNSIGNED_BYTE, nullptr);
+    return id;
+  }
+  void resetStore(AtlasStore &store) {
+    if (store.texture && !headless)
+      glDeleteTextures(1, &store.texture);
+    store.texture = 0;
+    store.pages.clear();
+    store.layerCapacity = 0;
+    store.maxPages = ATLAS_MEMORY_BUDGET / ((size_t)ATLAS_PAGE_SIZE *
+                                            ATLAS_PAGE_SIZE *
+                                            store.bytesPerPixel);
+    if (headless)
+      return;
+    GLint maxLayers = 0;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+    if ((size_t)maxLayers < store.maxPages)
+      store.maxPages = maxLayers;
+  }
+  void resetAtlas() {
+    resetStore(mono);
+    resetStore(color);
+  }
+  bool allocateOnPage(AtlasPage &page, int width, int height, int &x,
+                      int &y) {
+    AtlasShelf *best = nullptr;
+    for (auto &shelf : page.shelves) {
+      if (shelf.height < height || shelf.x + width > ATLAS_PAGE_SIZE)
+        continue;
+      if (!best || shelf.height < best->height)
+        best = &shelf;
+    }
+    // a much taller shelf would waste space, open a fitting one if possible
+    if ((!best || best->height > height * 2) &&
+        page.shelfTop + height <= ATLAS_PAGE_SIZE) {
+      page.shelves.push_back({page.shelfTop, height, 0});
+      page.shelfTop += height;
+      best = &page.shelves.back();
+    }
+    if (!best)
+      return false;
+    x = best->x;
+    y = best->y;
+    best->x += width;
+    return true;
+  }
+  bool addPage(AtlasStore &store) {
+    auto &pages = store.pages;
+    if (pages.size() >= store.maxPages)
+      return false;
+    if (pages.size() == store.layerCapacity) {
+      size_t capacity = store.layerCapacity ? store.layerCapacity * 2 : 1;
+      if (capacity > store.maxPages)
+        capacity = store.maxPages;
+      if (!headless) {
+        GLuint next = createTexture(store, capacity);
+        if (store.texture) {
+          GLuint fbo;
+          glGenFramebuffers(1, &fbo);
+          glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+          for (size_t layer = 0; layer < store.layerCapacity; layer++) {
+            glFramebufferTextureLayer(GL_READ_FRAMEBUFFER,
+                                      GL_COLOR_ATTACHMENT0, store.texture, 0,
+                                      (GLint)layer);
+            glCopyTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, (GLint)layer,
+                                0, 0, ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE);
+          }
+          glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+          glDeleteFramebuffers(1, &fbo);
+          glDeleteTextures(1, &store.texture);
+        }
+        store.texture = next;
+      }
+      store.layerCapacity = capacity;
+    }
+    pages.emplace_back();
+    return true;
+  }
+  int64_t evictPage(AtlasStore &store) {
+    auto &pages = store.pages;
+    int64_t victim = -1;
+    for (size_t i = 0; i < pages.size(); i++) {
+      if (!pages[i].pinned &&
+          (victim == -1 || pages[i].lastUsed < pages[victim].lastUsed))
+        victim = i;
+    }
+    if (victim == -1)
+      return -1;
+    auto &page = pages[victim];
+    if (page.lastUsed == frame)
+      evictedVisible = true;
+    layoutVersion++;
+    for (auto c : page.glyphs) {
+      auto *entry = entries.find(c);
+      if (entry && entry->slot)
+        freeSlots.push_back(entry->slot);
+      entries.erase(c);
+    }
+    page = AtlasPage();
+    return victim;
+  }
+  bool place(CharacterEntry &entry) {
+    const int width = entry.width + ATLAS_PADDING;
+    const int height = entry.height + ATLAS_PADDING;
+    if (width > ATLAS_PAGE_SIZE || height > ATLAS_PAGE_SIZE)
+      return false;
+    auto &store = storeFor(entry);
+    auto &pages = store.pages;
+    for (size_t i = pages.size(); i > 0; i--) {
+      if (allocateOnPage(pages[i - 1], width, height, entry.xPos,
+                         entry.yPos)) {
+        entry.page = i - 1;
+        pages[i - 1].glyphs.push_back(entry.c);
+        return true;
+      }
+    }
+    int64_t target = addPage(store) ? pages.size() - 1 : evictPage(store);
+    if (target == -1)
+      return false;
+    if (!allocateOnPage(pages[target], width, height, entry.xPos, entry.yPos))
+      return false;
+    entry.page = target;
+    pages[target].glyphs.push_back(entry.c);
+    return true;
+  }
+  // one sub image upload into the glyphs slot, the CPU copy isn't needed after
+  void upload(CharacterEntry &entry) {
+    if (!headless && entry.width > 0 && entry.height > 0) {
+      auto &store = storeFor(entry);
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D_ARRAY, store.texture);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+      glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, entry.xPos, entry.yPos,
+                      entry.page, entry.width, entry.height, 1, store.format,
+                      GL_UNSIGNED_BYTE, entry.data);
+    }
+    delete[] entry.data;
+    entry.data = nullptr;
   }
-  bool isColorEmojiFont(FT_Face &face) { return FT_HAS_COLOR(face); }
 };
 
 #endif
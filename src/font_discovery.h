@@ -0,0 +1,202 @@
+#ifndef FONT_DISCOVERY_H
+#define FONT_DISCOVERY_H
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fontconfig/fontconfig.h>
+#include "../third-party/json/json.hpp"
+
+struct FontEntry {
+  std::string path;
+  std::string name;
+  std::string type;
+};
+
+/*
+  Listing every installed font through fontconfig is slow on machines with
+  many fonts, so the monospace fonts and the chosen default are kept in a
+  small json file. A cached result is used right away and checked in the
+  background against the modification times of fontconfigs cache and font
+  directories, a stale file is rewritten for the next start. The check
+  only uses fontconfig objects of its own, so it doesn't share state with
+  fallback lookups. It gives up between its steps once shutdown() is
+  called, which waits for it, and the file is replaced by a rename so a
+  reader never sees it half written.
+*/
+class FontDiscovery {
+public:
+  static constexpr int VERSION = 1;
+  static FontDiscovery &get() {
+    static FontDiscovery instance;
+    return instance;
+  }
+  ~FontDiscovery() { shutdown(); }
+  // stops the check at its next step and waits for it, call before exit
+  void shutdown() {
+    stopping = true;
+    if (refresher.joinable())
+      refresher.join();
+  }
+  std::string defaultFont(const std::filesystem::path &cacheFile) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!cacheFile.empty() && load(cacheFile) &&
+        fileExists(cachedDefault)) {
+      if (!refreshing) {
+        refreshing = true;
+#if FC_VERSION >= 21100
+        // fontconfig is thread safe since 2.11
+        refresher = std::thread([this, cacheFile, cached = cachedStamp]() {
+          refresh(cacheFile, cached);
+        });
+#else
+        refresh(cacheFile, cachedStamp);
+#endif
+      }
+      return cachedDefault;
+    }
+    auto fonts = listMonospace();
+    auto chosen = pickDefault(fonts);
+    if (!cacheFile.empty())
+      save(cacheFile, stamp(), chosen, fonts);
+    return chosen;
+  }
+  static std::vector<FontEntry> listMonospace() {
+    std::vector<FontEntry> results;
+    FcConfig *config = FcInitLoadConfigAndFonts();
+    FcPattern *pat = FcPatternCreate();
+    FcObjectSet *objectSet = FcObjectSetBuild(FC_FAMILY, FC_STYLE, FC_LANG,
+                                              FC_FILE, FC_SPACING, nullptr);
+    FcFontSet *fSet = FcFontList(config, pat, objectSet);
+    for (int i = 0; fSet && i < fSet->nfont; i++) {
+      FcPattern *font = fSet->fonts[i];
+      FcChar8 *file, *family, *style;
+      int spacing;
+      if (FcPatternGetString(font, FC_FILE, 0, &file) == FcResultMatch &&
+          FcPatternGetInteger(font, FC_SPACING, 0, &spacing) == FcResultMatch &&
+          FcPatternGetString(font, FC_FAMILY, 0, &family) == FcResultMatch &&
+          FcPatternGetString(font, FC_STYLE, 0, &style) == FcResultMatch) {
+        if (spacing == 100)
+          results.push_back({std::string((const char *)file),
+                             std::string((const char *)family),
+                             std::string((const char *)style)});
+      }
+    }
+    if (fSet)
+      FcFontSetDestroy(fSet);
+    FcObjectSetDestroy(objectSet);
+    FcPatternDestroy(pat);
+    FcConfigDestroy(config);
+    return results;
+  }
+  static std::string pickDefault(const std::vector<FontEntry> &results) {
+    for (auto &entry : results) {
+      if (entry.name == "Hack" && entry.type == "Regular")
+        return entry.path;
+    }
+    for (auto &entry : results) {
+      if (entry.type == "Regular")
+        return entry.path;
+    }
+    return results.size() ? results[0].path : "";
+  }
+
+private:
+  std::mutex mutex;
+  std::thread refresher;
+  std::atomic<bool> stopping{false};
+  bool refreshing = false;
+  std::string cachedDefault;
+  int64_t cachedStamp = 0;
+
+  static bool fileExists(const std::string &path) {
+    std::error_code ec;
+    return path.length() && std::filesystem::exists(path, ec);
+  }
+  static int64_t mtime(const std::filesystem::path &path) {
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(path, ec);
+    if (ec)
+      return 0;
+    return time.time_since_epoch().count();
+  }
+  // newest change in fontconfigs caches or the configured font directories
+  static int64_t stamp() {
+    FcConfig *config = FcInitLoadConfig();
+    if (!config)
+      return 0;
+    int64_t newest = 0;
+    FcStrList *lists[] = {FcConfigGetCacheDirs(config),
+                          FcConfigGetFontDirs(config)};
+    for (auto *list : lists) {
+      if (!list)
+        continue;
+      while (FcChar8 *dir = FcStrListNext(list)) {
+        std::filesystem::path path((const char *)dir);
+        newest = std::max(newest, mtime(path));
+        std::error_code ec;
+        for (auto &entry : std::filesystem::directory_iterator(path, ec))
+          newest = std::max(newest, mtime(entry.path()));
+      }
+      FcStrListDone(list);
+    }
+    FcConfigDestroy(config);
+    return newest;
+  }
+  bool load(const std::filesystem::path &cacheFile) {
+    std::ifstream stream(cacheFile);
+    if (!stream)
+      return false;
+    auto cached = nlohmann::json::parse(stream, nullptr, false);
+    if (cached.is_discarded() || !cached.is_object() ||
+        cached.value("version", 0) != VERSION ||
+        !cached["default"].is_string() || !cached["stamp"].is_number())
+      return false;
+    cachedDefault = cached["default"];
+    cachedStamp = cached["stamp"];
+    return true;
+  }
+  static void save(const std::filesystem::path &cacheFile, int64_t stamp,
+                   const std::string &chosen,
+                   const std::vector<FontEntry> &fonts) {
+    nlohmann::json out;
+    out["version"] = VERSION;
+    out["stamp"] = stamp;
+    out["default"] = chosen;
+    auto list = nlohmann::json::array();
+    for (auto &font : fonts)
+      list.push_back({font.path, font.name, font.type});
+    out["monospace"] = list;
+    std::error_code ec;
+    std::filesystem::create_directories(cacheFile.parent_path(), ec);
+    // a name of its own, another instance may be writing the file too
+    auto tmp = cacheFile;
+    tmp += "." + std::to_string(std::random_device()()) + ".tmp";
+    bool written;
+    {
+      std::ofstream stream(tmp, std::ios::trunc);
+      stream << out.dump();
+      written = (bool)stream;
+    }
+    if (written)
+      std::filesystem::rename(tmp, cacheFile, ec);
+    if (!written || ec)
+      std::filesystem::remove(tmp, ec);
+  }
+  void refresh(const std::filesystem::path &cacheFile, int64_t cached) {
+    int64_t current = stamp();
+    if (stopping || current == cached)
+      return;
+    auto fonts = listMonospace();
+    if (stopping)
+      return;
+    save(cacheFile, current, pickDefault(fonts), fonts);
+  }
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef FONT_FALLBACK_H
+#define FONT_FALLBACK_H
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <fontconfig/fontconfig.h>
+#endif
+
+// a face id per codepoint, stored in pages of 256 so sparse use stays small
+class CodepointMemo {
+public:
+  static constexpr int16_t UNKNOWN = -2;
+  static constexpr int16_t NONE = -1;
+  int16_t get(char32_t c) const {
+    size_t page = c >> 8;
+    if (page >= pages.size() || !pages[page])
+      return UNKNOWN;
+    return (*pages[page])[c & 0xff];
+  }
+  void set(char32_t c, int16_t id) {
+    size_t page = c >> 8;
+    if (page >= PAGE_COUNT)
+      return;
+    if (page >= pages.size())
+      pages.resize(page + 1);
+    if (!pages[page]) {
+      pages[page] = std::make_unique<Page>();
+      pages[page]->fill(UNKNOWN);
+    }
+    (*pages[page])[c & 0xff] = id;
+  }
+  void clear() { pages.clear(); }
+
+private:
+  using Page = std::array<int16_t, 256>;
+  static const size_t PAGE_COUNT = 0x110000 >> 8;
+  std::vector<std::unique_ptr<Page>> pages;
+};
+
+/*
+  Finds an installed font for codepoints the configured fonts lack. The
+  candidates are fontconfigs sort order for the primary family, trimmed to
+  fonts that add coverage, queried once and then only checked by charset.
+*/
+class FontFallback {
+public:
+  ~FontFallback() { reset(); }
+  bool resolve(char32_t c, const std::string &family, std::string &path,
+               int &index) {
+#ifdef __linux__
+    if (!sorted || family != sortedFamily)
+      sort(family);
+    for (int i = 0; sorted && i < sorted->nfont; i++) {
+      FcPattern *font = sorted->fonts[i];
+      FcCharSet *charset;
+      FcChar8 *file;
+      if (FcPatternGetCharSet(font, FC_CHARSET, 0, &charset) !=
+              FcResultMatch ||
+          !FcCharSetHasChar(charset, c))
+        continue;
+      if (FcPatternGetString(font, FC_FILE, 0, &file) != FcResultMatch)
+        continue;
+      if (FcPatternGetInteger(font, FC_INDEX, 0, &index) != FcResultMatch)
+        index = 0;
+      path = (const char *)file;
+      return true;
+    }
+#endif
+    return false;
+  }
+
+private:
+#ifdef __linux__
+  FcFontSet *sorted = nullptr;
+  std::string sortedFamily;
+  void sort(const std::string &family) {
+    reset();
+    sortedFamily = family;
+    if (!FcInit())
+      return;
+    FcPattern *pattern = FcPatternCreate();
+    if (family.length())
+      FcPatternAddString(pattern, FC_FAMILY, (const FcChar8 *)family.c_str());
+    FcConfigSubstitute(nullptr, pattern, FcMatchPattern);
+    FcDefaultSubstitute(pattern);
+    FcResult result;
+    sorted = FcFontSort(nullptr, pattern, FcTrue, nullptr, &result);
+    FcPatternDestroy(pattern);
+  }
+#endif
+  void reset() {
+#ifdef __linux__
+    if (sorted)
+      FcFontSetDestroy(sorted);
+    sorted = nullptr;
+#endif
+  }
+};
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef GLYPH_CACHE_H
+#define GLYPH_CACHE_H
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "freetype/freetype.h"
+#include "shader.h"
+
+/*
+  Rasterized glyphs of one face at one size, kept on disk so a restart
+  doesn't run the SDF renderer again. The file is a header, records sorted
+  by codepoint and the packed bitmaps, it's mapped read only and rewritten
+  as a whole when new glyphs were added.
+*/
+class GlyphCache {
+public:
+  // bump when the rasterization or the file layout changes
+  static const uint32_t VERSION = 2;
+  int size = -1;
+  ~GlyphCache() { unmap(); }
+  /*
+    Names the font file by its path, size and modification time, a font
+    replaced or updated in place gets a new cache. Only a stat, reading
+    a large CJK or emoji font to hash it would delay the start.
+  */
+  static uint64_t fontKey(const std::string &path) {
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(path, ec);
+    if (ec)
+      size = 0;
+    auto modified = std::filesystem::last_write_time(path, ec);
+    uint64_t time = ec ? 0 : (uint64_t)modified.time_since_epoch().count();
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const void *data, size_t length) {
+      for (size_t i = 0; i < length; i++) {
+        hash ^= ((const uint8_t *)data)[i];
+        hash *= 1099511628211ull;
+      }
+    };
+    mix(path.data(), path.size());
+    mix(&size, sizeof(size));
+    mix(&time, sizeof(time));
+    return hash;
+  }
+  static std::filesystem::path fileName(const std::filesystem::path &dir,
+                                        uint64_t fontKey, long faceIndex,
+                                        int size) {
+    char name[128];
+    snprintf(name, sizeof(name), "%016llx-%ld-%d-v%u-ft%d.%d.%d.glyphs",
+             (unsigned long long)fontKey, faceIndex, size, VERSION,
+             FREETYPE_MAJOR, FREETYPE_MINOR, FREETYPE_PATCH);
+    return dir / name;
+  }
+  void open(const std::filesystem::path &file, int size) {
+    unmap();
+    fresh.clear();
+    this->file = file;
+    this->size = size;
+    map();
+  }
+  // fills the metrics and a copy of the bitmap, false if c isn't cached
+  bool find(char32_t c, CharacterEntry &entry) const {
+    auto *record = findRecord(c);
+    if (!record)
+      return false;
+    entry.c = c;
+    entry.width = record->width;
+    entry.height = record->height;
+    entry.top = record->top;
+    entry.left = record->left;
+    entry.advance = record->advance;
+    entry.advanceY = record->advanceY;
+    entry.hasColor = record->hasColor;
+    size_t bytes = bitmapSize(*record);
+    entry.data = new uint8_t[bytes];
+    memcpy(entry.data, mapped + record->offset, bytes);
+    return true;
+  }
+  // entry.data has to be the rasterized bitmap, it's copied
+  void add(const CharacterEntry &entry) {
+    if (!entry.data || findRecord(entry.c))
+      return;
+    fresh.push_back(entry);
+  }
+  bool dirty() const { return !fresh.empty(); }
+  void save() {
+    if (fresh.empty() || file.empty())
+      return;
+    std::vector<Record> records(this->records, this->records + count);
+    std::vector<const uint8_t *> sources;
+    for (auto &record : records)
+      sources.push_back(mapped + record.offset);
+    for (auto &entry : fresh) {
+      Record record;
+      record.c = entry.c;
+      record.width = entry.width;
+      record.height = entry.height;
+      record.top = entry.top;
+      record.left = entry.left;
+      record.advance = entry.advance;
+      record.advanceY = entry.advanceY;
+      record.hasColor = entry.hasColor;
+      records.push_back(record);
+      sources.push_back(entry.data);
+    }
+    std::vector<size_t> order(records.size());
+    for (size_t i = 0; i < order.size(); i++)
+      order[i] = i;
+    std::sort(order.begin(), order.end(), [&records](size_t a, size_t b) {
+      return records[a].c < records[b].c;
+    });
+    Header header;
+    header.count = records.size();
+    std::vector<Record> sorted;
+    uint64_t offset = sizeof(Header) + sizeof(Record) * records.size();
+    for (auto i : order) {
+      sorted.push_back(records[i]);
+      sorted.back().offset = offset;
+      offset += bitmapSize(records[i]);
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(file.parent_path(), ec);
+    auto tmp = file;
+    tmp += ".tmp";
+    {
+      std::ofstream stream(tmp, std::ios::binary | std::ios::trunc);
+      if (!stream)
+        return;
+      stream.write((const char *)&header, sizeof(header));
+      stream.write((const char *)sorted.data(),
+                   sizeof(Record) * sorted.size());
+      for (auto i : order) {
+        if (sources[i])
+          stream.write((const char *)sources[i], bitmapSize(records[i]));
+      }
+      if (!stream)
+        return;
+    }
+    unmap();
+    std::filesystem::rename(tmp, file, ec);
+    fresh.clear();
+    map();
+  }
+
+private:
+  struct Header {
+    char magic[4] = {'L', 'G', 'C', 'F'};
+    uint32_t version = VERSION;
+    uint32_t count = 0;
+    uint32_t reserved = 0;
+  };
+  struct Record {
+    uint32_t c;
+    float width;
+    float height;
+    float top;
+    float left;
+    float advance;
+    float advanceY;
+    uint32_t hasColor;
+    uint64_t offset;
+  };
+  std::filesystem::path file;
+  const uint8_t *mapped = nullptr;
+  size_t mappedSize = 0;
+  const Record *records = nullptr;
+  size_t count = 0;
+  std::vector<CharacterEntry> fresh;
+#ifdef _WIN32
+  std::vector<uint8_t> contents;
+#endif
+
+  static size_t bitmapSize(const Record &record) {
+    return (size_t)record.width * (size_t)record.height *
+           (record.hasColor ? 4 : 1);
+  }
+  const Record *findRecord(char32_t c) const {
+    auto *end = records + count;
+    auto *it = std::lower_bound(
+        records, end, c,
+        [](const Record &r, char32_t value) { return r.c < value; });
+    if (it == end || it->c != c)
+      return nullptr;
+    return it;
+  }
+  void map() {
+#ifdef _WIN32
+    std::ifstream stream(file, std::ios::binary);
+    if (!stream)
+      return;
+    contents.assign(std::istreambuf_iterator<char>(stream),
+                    std::istreambuf_iterator<char>());
+    mapped = contents.data();
+    mappedSize = contents.size();
+#else
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+      void *data =
+          mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        mapped = (const uint8_t *)data;
+        mappedSize = info.st_size;
+      }
+    }
+    close(fd);
+#endif
+    if (!validate())
+      unmap();
+  }
+  bool validate() {
+    if (!mapped || mappedSize < sizeof(Header))
+      return false;
+    Header expected;
+    auto *header = (const Header *)mapped;
+    if (memcmp(header->magic, expected.magic, 4) ||
+        header->version != VERSION)
+      return false;
+    if (mappedSize < sizeof(Header) + sizeof(Record) * header->count)
+      return false;
+    records = (const Record *)(mapped + sizeof(Header));
+    count = header->count;
+    for (size_t i = 0; i < count; i++) {
+      if (records[i].offset + bitmapSize(records[i]) > mappedSize)
+        return false;
+    }
+    return true;
+  }
+  void unmap() {
+#ifdef _WIN32
+    contents.clear();
+#else
+    if (mapped)
+      munmap((void *)mapped, mappedSize);
+#endif
+    mapped = nullptr;
+    mappedSize = 0;
+    records = nullptr;
+    count = 0;
+  }
+};
+
+#endif
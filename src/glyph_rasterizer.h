@@ -0,0 +1,186 @@
+#ifndef GLYPH_RASTERIZER_H
+#define GLYPH_RASTERIZER_H
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "freetype/freetype.h"
+#include "freetype/ftmodapi.h"
+#include "shader.h"
+
+/*
+  Distance range in pixels around the outline, wide enough that glyphs
+  rendered at the reference size still antialias when zoomed far out.
+  Relative to the reference size it matches FreeTypes default spread of 8
+  at 32px, so line heights are unchanged.
+*/
+const FT_Int SDF_SPREAD = 16;
+inline void configureSdf(FT_Library library) {
+  FT_Int spread = SDF_SPREAD;
+  FT_Property_Set(library, "sdf", "spread", &spread);
+  FT_Property_Set(library, "bsdf", "spread", &spread);
+}
+
+// loads c from face and copies the bitmap, SDF for outlines, RGBA for color
+inline bool rasterizeGlyph(FT_Face face, char32_t c, bool hasColor,
+                           CharacterEntry &entry) {
+  auto f = FT_LOAD_RENDER;
+  if (hasColor)
+    f |= FT_LOAD_COLOR;
+  else
+    f |= FT_LOAD_TARGET_(FT_RENDER_MODE_SDF);
+  if (FT_Load_Char(face, c, f))
+    return false;
+  auto bm = face->glyph->bitmap;
+  entry.c = c;
+  entry.width = bm.width;
+  entry.height = bm.rows;
+  entry.top = face->glyph->bitmap_top;
+  entry.left = face->glyph->bitmap_left;
+  entry.advance = face->glyph->advance.x >> 6;
+  entry.hasColor = hasColor;
+  size_t pixels = (size_t)bm.width * bm.rows;
+  if (hasColor) {
+    entry.data = new uint8_t[pixels * 4];
+    for (size_t i = 0; i < pixels * 4; i += 4) {
+      entry.data[i + 2] = bm.buffer[i];
+      entry.data[i + 1] = bm.buffer[i + 1];
+      entry.data[i] = bm.buffer[i + 2];
+      entry.data[i + 3] = bm.buffer[i + 3];
+    }
+  } else {
+    entry.data = new uint8_t[pixels];
+    if (bm.buffer)
+      memcpy(entry.data, bm.buffer, pixels);
+  }
+  return true;
+}
+
+struct GlyphJob {
+  char32_t c;
+  std::string path;
+  FT_Long faceIndex;
+  bool hasColor;
+  // pixel size for outline fonts, strike index for color bitmap fonts
+  int size;
+  uint64_t generation;
+};
+struct GlyphResult {
+  GlyphJob job;
+  bool ok = false;
+  CharacterEntry entry;
+};
+
+/*
+  Rasterizes glyphs away from the render loop. FreeType faces must not be
+  shared between threads, so each worker opens its own library and faces.
+  Finished glyphs are collected until the atlas takes them at the start of
+  the next frame.
+*/
+class GlyphRasterizer {
+public:
+  // called from a worker once a result is waiting, used to wake the loop
+  std::function<void()> onReady;
+  GlyphRasterizer() {
+    unsigned count = std::thread::hardware_concurrency();
+    count = count > 2 ? count - 1 : 1;
+    if (count > MAX_WORKERS)
+      count = MAX_WORKERS;
+    for (unsigned i = 0; i < count; i++)
+      workers.emplace_back([this]() { run(); });
+  }
+  ~GlyphRasterizer() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+  void request(GlyphJob job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(std::move(job));
+    }
+    wake.notify_one();
+  }
+  // drops queued jobs, running ones are filtered by their generation
+  void cancel() {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.clear();
+  }
+  bool hasResults() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return !results.empty();
+  }
+  std::vector<GlyphResult> takeResults() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<GlyphResult> out;
+    out.swap(results);
+    return out;
+  }
+
+private:
+  static const unsigned MAX_WORKERS = 4;
+  struct WorkerFace {
+    FT_Face face = nullptr;
+    int size = -1;
+  };
+  std::vector<std::thread> workers;
+  std::deque<GlyphJob> jobs;
+  std::vector<GlyphResult> results;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+
+  void run() {
+    FT_Library library;
+    if (FT_Init_FreeType(&library))
+      return;
+    configureSdf(library);
+    std::map<std::pair<std::string, FT_Long>, WorkerFace> faces;
+    while (true) {
+      GlyphJob job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+        if (stopping)
+          break;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      GlyphResult result;
+      result.job = job;
+      auto &face = faces[std::pair(job.path, job.faceIndex)];
+      if (!face.face &&
+          FT_New_Face(library, job.path.c_str(), job.faceIndex, &face.face))
+        face.face = nullptr;
+      if (face.face) {
+        if (face.size != job.size) {
+          if (job.hasColor)
+            FT_Select_Size(face.face, job.size);
+          else
+            FT_Set_Pixel_Sizes(face.face, 0, job.size);
+          face.size = job.size;
+        }
+        result.ok =
+            rasterizeGlyph(face.face, job.c, job.hasColor, result.entry);
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        results.push_back(std::move(result));
+      }
+      if (onReady)
+        onReady();
+    }
+    FT_Done_FreeType(library);
+  }
+};
+
+#endif
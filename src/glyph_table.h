@@ -0,0 +1,134 @@
+#ifndef GLYPH_TABLE_H
+#define GLYPH_TABLE_H
+#include <cstdint>
+#include <vector>
+#include "shader.h"
+
+/*
+  Glyph lookup for the render loop. Latin-1 is indexed directly, everything
+  else lives in an open addressing table with linear probing, erasing
+  shifts the following entries back so no tombstones pile up.
+*/
+class GlyphTable {
+public:
+  static const char32_t DIRECT_SIZE = 256;
+  GlyphTable() { clear(); }
+  CharacterEntry *find(char32_t c) {
+    if (c < DIRECT_SIZE)
+      return directUsed[c] ? &direct[c] : nullptr;
+    if (!hashed)
+      return nullptr;
+    for (size_t i = slotFor(c);; i = (i + 1) & mask) {
+      auto &slot = slots[i];
+      if (!slot.used)
+        return nullptr;
+      if (slot.entry.c == c)
+        return &slot.entry;
+    }
+  }
+  bool count(char32_t c) { return find(c) != nullptr; }
+  // the returned reference is valid until the next insert or erase
+  CharacterEntry &insert(const CharacterEntry &entry) {
+    const char32_t c = entry.c;
+    if (c < DIRECT_SIZE) {
+      if (!directUsed[c])
+        directCount++;
+      directUsed[c] = true;
+      direct[c] = entry;
+      return direct[c];
+    }
+    if ((hashed + 1) * 4 > slots.size() * 3)
+      grow();
+    size_t i = slotFor(c);
+    while (slots[i].used && slots[i].entry.c != c)
+      i = (i + 1) & mask;
+    if (!slots[i].used)
+      hashed++;
+    slots[i].used = true;
+    slots[i].entry = entry;
+    return slots[i].entry;
+  }
+  void erase(char32_t c) {
+    if (c < DIRECT_SIZE) {
+      if (directUsed[c])
+        directCount--;
+      directUsed[c] = false;
+      direct[c] = CharacterEntry();
+      return;
+    }
+    if (!hashed)
+      return;
+    size_t i = slotFor(c);
+    while (slots[i].used && slots[i].entry.c != c)
+      i = (i + 1) & mask;
+    if (!slots[i].used)
+      return;
+    hashed--;
+    slots[i] = Slot();
+    for (size_t j = (i + 1) & mask; slots[j].used; j = (j + 1) & mask) {
+      size_t home = slotFor(slots[j].entry.c);
+      // entries whose probe sequence passes the hole move into it
+      bool canMove =
+          i <= j ? (home <= i || home > j) : (home <= i && home > j);
+      if (!canMove)
+        continue;
+      slots[i] = slots[j];
+      slots[j] = Slot();
+      i = j;
+    }
+  }
+  void clear() {
+    direct.assign(DIRECT_SIZE, CharacterEntry());
+    directUsed.assign(DIRECT_SIZE, false);
+    directCount = 0;
+    slots.assign(INITIAL_SLOTS, Slot());
+    mask = INITIAL_SLOTS - 1;
+    shift = 64 - INITIAL_BITS;
+    hashed = 0;
+  }
+  size_t size() const { return directCount + hashed; }
+  template <typename F> void forEach(F f) {
+    for (char32_t c = 0; c < DIRECT_SIZE; c++)
+      if (directUsed[c])
+        f(direct[c]);
+    for (auto &slot : slots)
+      if (slot.used)
+        f(slot.entry);
+  }
+
+private:
+  struct Slot {
+    bool used = false;
+    CharacterEntry entry;
+  };
+  static const size_t INITIAL_BITS = 8;
+  static const size_t INITIAL_SLOTS = 1 << INITIAL_BITS;
+  std::vector<CharacterEntry> direct;
+  std::vector<bool> directUsed;
+  std::vector<Slot> slots;
+  size_t directCount = 0;
+  size_t hashed = 0;
+  size_t mask = 0;
+  size_t shift = 0;
+
+  size_t slotFor(char32_t c) const {
+    return (size_t)(((uint64_t)c * 0x9E3779B97F4A7C15ull) >> shift);
+  }
+  void grow() {
+    std::vector<Slot> old;
+    old.swap(slots);
+    slots.assign(old.size() * 2, Slot());
+    mask = slots.size() - 1;
+    shift--;
+    for (auto &slot : old) {
+      if (!slot.used)
+        continue;
+      size_t i = slotFor(slot.entry.c);
+      while (slots[i].used)
+        i = (i + 1) & mask;
+      slots[i] = slot;
+    }
+  }
+};
+
+#endif
@@ -2,12 +2,15 @@
 #define HIGHLIGHTING_H
 #include "la.h"
 
+#include <algorithm>
 #include <string>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <unordered_map>
 #include <vector>
 #include "utf8String.h"
+#include "bracket_index.h"
 
 const std::string DEFAULT_WHITESPACE_CHARS = " \t\n[]{}();:.,*-+/";
 struct EditorColors {
@@ -25,6 +28,10 @@ struct EditorColors {
   Vec4f line_number_color = vec4fs(0.8);
   Vec4f cursor_color_standard = vec4f(0.8, 0.8, 0.8, 1);
   Vec4f cursor_color_vim = vec4f(0.8, 0.8, 0.8, 0.5);
+  Vec4f occurrence_color = vec4f(0.5, 0.5, 0.5, 0.3);
+  std::vector<Vec4f> bracket_colors = {vec4f(0.9, 0.7, 0.2, 1.0),
+                                       vec4f(0.7, 0.4, 0.9, 1.0),
+                                       vec4f(0.3, 0.7, 0.9, 1.0)};
 };
 struct Language {
   std::string modeName;
@@ -46,28 +53,98 @@ struct LanguageExpanded {
   Utf8String stringCharacters;
   std::unordered_map<char32_t, bool> whitespace;
   char32_t escapeChar;
+  // decoded once for the lexer
+  std::vector<char32_t> singleLinePoints;
+  std::vector<char32_t> multiLineStartPoints;
+  std::vector<char32_t> multiLineEndPoints;
+  std::vector<char32_t> stringPoints;
 };
-struct HighlighterState {
+/*
+  Compiled language tables are shared between all buffers using the same
+  language, they are released once the last buffer drops them.
+*/
+inline std::shared_ptr<const LanguageExpanded>
+expandLanguage(const Language &lang) {
+  static std::unordered_map<std::string, std::weak_ptr<const LanguageExpanded>>
+      compiled;
+  auto &slot = compiled[lang.modeName];
+  if (auto existing = slot.lock())
+    return existing;
+  auto expanded = std::make_shared<LanguageExpanded>();
+  expanded->modeName = Utf8String(lang.modeName);
+  for (auto &entry : lang.keyWords)
+    expanded->keyWords[entry] = 1;
+  for (auto &entry : lang.specialWords)
+    expanded->specialWords[entry] = 1;
+  if (lang.singleLineComment.length())
+    expanded->singleLineComment = Utf8String(lang.singleLineComment);
+  if (lang.multiLineComment.first.length())
+    expanded->multiLineComment =
+        std::pair(Utf8String(lang.multiLineComment.first),
+                  Utf8String(lang.multiLineComment.second));
+  else
+    expanded->multiLineComment = std::pair(U"", U"");
+  expanded->stringCharacters = Utf8String(lang.stringCharacters);
+  expanded->escapeChar = (char32_t)lang.escapeChar;
+  Utf8String whitespaceChars(lang.whitespace);
+  for (auto c : whitespaceChars)
+    expanded->whitespace[c] = true;
+  expanded->singleLinePoints = expanded->singleLineComment.getCodePoints();
+  expanded->multiLineStartPoints =
+      expanded->multiLineComment.first.getCodePoints();
+  expanded->multiLineEndPoints =
+      expanded->multiLineComment.second.getCodePoints();
+  expanded->stringPoints = expanded->stringCharacters.getCodePoints();
+  slot = expanded;
+  return expanded;
+}
+enum class TokenKind : uint8_t {
+  Default,
+  String,
+  Keyword,
+  Special,
+  Number,
+  Comment
+};
+struct LineState {
+  // 0: code, 1: string, 3: multi line comment
+  uint8_t mode = 0;
+  char32_t stringChar = 0;
+  bool operator==(const LineState &other) const {
+    return mode == other.mode && stringChar == other.stringChar;
+  }
+  bool operator!=(const LineState &other) const { return !(*this == other); }
+};
+struct HighlightSpan {
+  int start;
+  TokenKind kind;
+};
+// identifier occurrence, id refers to the highlighters word table
+struct WordSpan {
   int start;
-  bool busy;
-  bool wasReset;
-  int mode;
-  Utf8String buffer;
-  char stringChar;
+  int end;
+  uint32_t id;
 };
-struct SavedState {
-  HighlighterState state;
-  Vec4f color;
-  bool loaded = false;
+struct LineHighlight {
+  uint64_t revision = 0;
+  LineState entry;
+  LineState exit;
+  std::vector<WordSpan> words;
+  std::vector<HighlightSpan> spans;
 };
 class Highlighter {
 public:
   Utf8String languageName;
-
-  LanguageExpanded language;
+  std::shared_ptr<const LanguageExpanded> language;
+  std::vector<LineHighlight> lineCache;
+  BracketIndex brackets;
+  // interned identifiers and how often each occurs in the buffer, the ids
+  // of words that no longer occur are given to new ones
+  std::unordered_map<std::string, uint32_t> wordIds;
+  std::vector<size_t> wordCounts;
   bool isNonChar(char32_t c) {
 
-    return language.whitespace.count(c);
+    return language->whitespace.count(c);
   }
  bool isNumber(char32_t c) {
   return c >= '0' && c <= '9';
@@ -77,247 +154,318 @@ public:
     return false;
   return !isNumber(c) && c != '.' && c != 'x';
  }
-  std::map<int, Vec4f> cached;
-  std::map<int, std::pair<int, int>> lineIndex;
-  Vec4f lastEntry;
-  int lastSkip = 0;
-  int lastMax = 0;
-  size_t last_history_size = 0;
-  int lastY = 0;
-  SavedState savedState;
-  bool wasCached = false;
-  bool wasEntire = false;
-  void setLanguage(Language lang, std::string name) {
-    language.modeName = create(lang.modeName);
-    language.keyWords.clear();
-    for(auto& entry : lang.keyWords) {
-      language.keyWords[entry] = 1;
-    }
-    language.specialWords.clear();
-    for(auto& entry : lang.specialWords) {
-      language.specialWords[entry] = 1;
+  void setLanguage(const Language &lang, std::string name) {
+    auto expanded = expandLanguage(lang);
+    // same compiled table as before, the cached lines are still valid
+    if (expanded == language)
+      return;
+    language = expanded;
+    languageName = Utf8String(name);
+    lineCache.clear();
+    brackets.reset();
+    wordIds.clear();
+    wordCounts.clear();
+    wordNames.clear();
+    freeWordIds.clear();
+    releasedWords.clear();
+  }
+  static Vec4f colorFor(TokenKind kind, const EditorColors *colors) {
+    switch (kind) {
+    case TokenKind::String:
+      return colors->string_color;
+    case TokenKind::Keyword:
+      return colors->keyword_color;
+    case TokenKind::Special:
+      return colors->special_color;
+    case TokenKind::Number:
+      return colors->number_color;
+    case TokenKind::Comment:
+      return colors->comment_color;
+    default:
+      return colors->default_color;
     }
-    if(lang.singleLineComment.length()) {
-      language.singleLineComment = create(lang.singleLineComment);
-    } else {
-      language.singleLineComment = U"";
+  }
+  static Vec4f bracketColorFor(int depth, const EditorColors *colors) {
+    const int count = colors->bracket_colors.size();
+    if (!count)
+      return colors->default_color;
+    return colors->bracket_colors[((depth % count) + count) % count];
+  }
+  const std::vector<HighlightSpan> *getSpans(size_t y) const {
+    if (y >= lineCache.size())
+      return nullptr;
+    return &lineCache[y].spans;
+  }
+  const std::vector<WordSpan> *getWords(size_t y) const {
+    if (y >= lineCache.size())
+      return nullptr;
+    return &lineCache[y].words;
+  }
+  // id of the identifier at x/y or -1
+  int64_t wordAt(int x, size_t y) const {
+    if (y >= lineCache.size())
+      return -1;
+    const auto &words = lineCache[y].words;
+    auto it = std::upper_bound(
+        words.begin(), words.end(), x,
+        [](int value, const WordSpan &word) { return value < word.end; });
+    if (it == words.end() || it->start > x)
+      return -1;
+    return it->id;
+  }
+  size_t wordCount(uint32_t id) const {
+    return id < wordCounts.size() ? wordCounts[id] : 0;
+  }
+  // index of the span covering column x
+  static size_t spanAt(const std::vector<HighlightSpan> &spans, int x) {
+    auto it = std::upper_bound(
+        spans.begin(), spans.end(), x,
+        [](int value, const HighlightSpan &span) { return value < span.start; });
+    return it == spans.begin() ? 0 : (it - spans.begin()) - 1;
+  }
+  /*
+    Brings the per line cache in sync with the buffer. Lines are matched by
+    their revision, only changed lines are lexed again and lexing continues
+    below them while the state carried into the next line differs.
+  */
+  void update(std::vector<Utf8String> &lines) {
+    const size_t limit = std::min(lineCache.size(), lines.size());
+    size_t prefix = 0;
+    while (prefix < limit &&
+           lineCache[prefix].revision == lines[prefix].getRevision())
+      prefix++;
+    size_t suffix = 0;
+    while (suffix < limit - prefix &&
+           lineCache[lineCache.size() - 1 - suffix].revision ==
+               lines[lines.size() - 1 - suffix].getRevision())
+      suffix++;
+    update(lines, prefix, suffix);
+  }
+  /*
+    update() for callers that know where the buffer was edited: the first
+    `from` and the last `tail` lines are the same as at the last update, so
+    only the lines in between are compared.
+  */
+  void update(std::vector<Utf8String> &lines, size_t from, size_t tail) {
+    const size_t oldCount = lineCache.size();
+    const size_t newCount = lines.size();
+    const size_t limit = std::min(oldCount, newCount);
+    const size_t prefix = std::min(from, limit);
+    if (prefix == oldCount && prefix == newCount)
+      return;
+    const size_t suffix = std::min(tail, limit - prefix);
+    const size_t oldMiddle = oldCount - prefix - suffix;
+    const size_t newMiddle = newCount - prefix - suffix;
+    if (oldMiddle != newMiddle) {
+      for (size_t i = prefix; i < prefix + oldMiddle; i++)
+        forgetWords(lineCache[i]);
+      lineCache.erase(lineCache.begin() + prefix,
+                      lineCache.begin() + prefix + oldMiddle);
+      lineCache.insert(lineCache.begin() + prefix, newMiddle, LineHighlight());
+      brackets.splice(prefix, oldMiddle, newMiddle);
     }
-    if(lang.multiLineComment.first.length()) {
-      language.multiLineComment = std::pair(create(lang.multiLineComment.first), create(lang.multiLineComment.second));
-    } else {
-      language.multiLineComment = std::pair(U"", U"");
+    const size_t middleEnd = prefix + newMiddle;
+    for (size_t i = prefix; i < newCount; i++) {
+      LineState in = i == 0 ? LineState() : lineCache[i - 1].exit;
+      auto &entry = lineCache[i];
+      if (entry.revision == lines[i].getRevision() && entry.entry == in) {
+        if (i >= middleEnd)
+          break;
+        continue;
+      }
+      lexLine(lines[i], in, entry, i);
     }
-    language.stringCharacters = create(lang.stringCharacters);
-    language.escapeChar = (char32_t) lang.escapeChar;
+    brackets.commit();
+    releaseWords();
+  }
+private:
+  // key of each word id in wordIds, null once the id is free
+  std::vector<const std::string *> wordNames;
+  std::vector<uint32_t> freeWordIds;
+  // ids whose count dropped to zero during the current update
+  std::vector<uint32_t> releasedWords;
 
-    Utf8String whitespaceChars(lang.whitespace);
-    language.whitespace.clear();
-    for(auto c : whitespaceChars){
-        language.whitespace[c] = true;
+  void forgetWords(LineHighlight &entry) {
+    for (auto &word : entry.words) {
+      if (--wordCounts[word.id] == 0)
+        releasedWords.push_back(word.id);
     }
-
-    languageName = create(name);
-    wasCached = false;
+    entry.words.clear();
   }
-  std::map<int, Vec4f>* highlight(std::vector<Utf8String>& lines, EditorColors* colors, int skip, int maxLines, int y, size_t history_size) {
-    Utf8String str;
-    for(size_t i = 0; i < lines.size(); i++) {
-      str += lines[i];
-      if(i < lines.size() -1)
-        str += U"\n";
+  // drops the words that didn't come back in the lines lexed again
+  void releaseWords() {
+    for (auto id : releasedWords) {
+      if (wordCounts[id] || !wordNames[id])
+        continue;
+      wordIds.erase(wordIds.find(*wordNames[id]));
+      wordNames[id] = nullptr;
+      freeWordIds.push_back(id);
     }
-    return highlight(str, colors, skip, maxLines, y, history_size);
+    releasedWords.clear();
   }
-  std::map<int, Vec4f>* get() {
-    return &cached;
+  uint32_t internWord(const std::string &word) {
+    auto inserted = wordIds.emplace(word, 0);
+    if (!inserted.second)
+      return inserted.first->second;
+    uint32_t id;
+    if (freeWordIds.size()) {
+      id = freeWordIds.back();
+      freeWordIds.pop_back();
+    } else {
+      id = wordCounts.size();
+      wordCounts.push_back(0);
+      wordNames.push_back(nullptr);
+    }
+    wordNames[id] = &inserted.first->first;
+    inserted.first->second = id;
+    return id;
   }
-  std::map<int, Vec4f>* highlight(Utf8String& raw, EditorColors* colors, int skip, int maxLines, int yPassed, size_t history_size) {
-    if(wasCached && wasEntire && history_size == last_history_size)
-      return &cached;
-
-     std::map<int, Vec4f> entries;
-    if(skip != lastSkip) {
-      wasCached = false;
-      wasEntire = true;
+  void pushSpan(std::vector<HighlightSpan> &spans, int start, TokenKind kind) {
+    if (spans.size() && spans.back().start == start) {
+      spans.pop_back();
+    }
+    if (spans.size() && spans.back().kind == kind)
+      return;
+    spans.push_back({start, kind});
+  }
+  bool matchesAt(const std::vector<char32_t> &cps, size_t i,
+                 const std::vector<char32_t> &what) {
+    const size_t len = what.size();
+    if (!len || i + len > cps.size())
+      return false;
+    for (size_t k = 0; k < len; k++) {
+      if (cps[i + k] != what[k])
+        return false;
+    }
+    return true;
+  }
+  void appendUtf8(std::string &out, char32_t cp) {
+    if (cp <= 0x7F) {
+      out += (char)cp;
+    } else if (cp <= 0x07FF) {
+      out += (char)(((cp >> 6) & 0x1F) | 0xC0);
+      out += (char)((cp & 0x3F) | 0x80);
+    } else if (cp <= 0xFFFF) {
+      out += (char)(((cp >> 12) & 0x0F) | 0xE0);
+      out += (char)(((cp >> 6) & 0x3F) | 0x80);
+      out += (char)((cp & 0x3F) | 0x80);
     } else {
-      wasEntire = !wasCached;
+      out += (char)(((cp >> 18) & 0x07) | 0xF0);
+      out += (char)(((cp >> 12) & 0x3F) | 0x80);
+      out += (char)(((cp >> 6) & 0x3F) | 0x80);
+      out += (char)((cp & 0x3F) | 0x80);
     }
-
-    HighlighterState state =  {0, false, false, 0, U"", 0};
-    int startIndex = 0;
-    int y = 0;
-    lineIndex.clear();
-    Vec4f string_color = colors->string_color;
-    Vec4f default_color = colors->default_color;
-    Vec4f keyword_color = colors->keyword_color;
-    Vec4f special_color = colors->special_color;
-    Vec4f comment_color = colors->comment_color;
-    Vec4f number_color = colors->number_color;
-    char32_t last = 0;
-    size_t i;
-    size_t lCount = 0;
-    int last_entry = -1;
-    bool wasTriggered = false;
-    auto vec = raw.getCodePoints();
-    for(i = 0; i < raw.length(); i++) {
-      char32_t current = vec[i];
-      if(current == '\n') {
-        int endIndex = entries.size();
-        lineIndex[y++] = std::pair<int, int>(startIndex, endIndex);
-        startIndex = endIndex;
-        if(lCount++ > skip + maxLines && wasCached)
-          break;
-      }
-      if(skip > 0 && wasCached && lCount < skip-1) {
+  }
+  void lexLine(Utf8String &line, LineState state, LineHighlight &entry,
+               size_t y) {
+    entry.revision = line.getRevision();
+    entry.entry = state;
+    entry.spans.clear();
+    forgetWords(entry);
+    std::vector<BracketEntry> found;
+    const LanguageExpanded *lang = language.get();
+    auto cps = line.getCodePoints();
+    const size_t n = cps.size();
+    pushSpan(entry.spans, 0,
+             state.mode == 1   ? TokenKind::String
+             : state.mode == 3 ? TokenKind::Comment
+                               : TokenKind::Default);
+    size_t i = 0;
+    std::string word;
+    while (i < n) {
+      char32_t current = cps[i];
+      if (state.mode == 3) {
+        if (matchesAt(cps, i, lang->multiLineEndPoints)) {
+          i += lang->multiLineEndPoints.size();
+          state.mode = 0;
+          pushSpan(entry.spans, i, TokenKind::Default);
+        } else {
+          i++;
+        }
         continue;
       }
-       if (state.busy && (state.mode == 6 || state.mode == 7) && isNumberEnd(current, state.mode == 7)) {
-        state.buffer = U"";
-        state.busy = false;
-        state.mode = 0;
-        entries[i] = default_color;
-        last_entry = i;
-      } 
-      if(language.stringCharacters.find(current) != std::string::npos && (last != language.escapeChar || (last == language.escapeChar && i >1 && raw[i-2] == language.escapeChar))) {
-        if(state.mode == 0 && !state.busy) {
-          state.mode = 1;
-          state.busy = true;
-          state.start = i;
-          state.stringChar = current;
-          entries[i] = string_color;
-          last_entry = i;
-        } else if (state.mode == 1 && current == state.stringChar) {
-          state.busy = false;
+      if (state.mode == 1) {
+        if (current == lang->escapeChar) {
+          i += 2;
+          continue;
+        }
+        i++;
+        if (current == state.stringChar) {
           state.mode = 0;
-          state.start = 0;
-          entries[i+1] = default_color;
-          last_entry = i+1;
+          pushSpan(entry.spans, i, TokenKind::Default);
         }
-      } else if (state.busy && state.mode == 3 && hasEnding(state.buffer, language.multiLineComment.second)) {
-        state.mode = 0;
-        state.busy = false;
-        entries[i] = default_color;
-        last_entry = i;
-      } else if ((!state.busy || state.mode == 2) && language.multiLineComment.first.length() && hasEnding(state.buffer, language.multiLineComment.first)) {
-        entries[i- language.multiLineComment.first.length()] = comment_color;
-        last_entry = i- (language.multiLineComment.first.length());
-        state.buffer = U"";
-        state.busy = true;
+        continue;
+      }
+      bool open;
+      int type = BracketIndex::bracketType(current, open);
+      if (type != -1) {
+        found.push_back({(int)i, (uint8_t)type, open});
+        i++;
+        continue;
+      }
+      if (!lang) {
+        i++;
+        continue;
+      }
+      if (matchesAt(cps, i, lang->singleLinePoints)) {
+        pushSpan(entry.spans, i, TokenKind::Comment);
+        break;
+      }
+      if (matchesAt(cps, i, lang->multiLineStartPoints)) {
+        pushSpan(entry.spans, i, TokenKind::Comment);
+        i += lang->multiLineStartPoints.size();
         state.mode = 3;
-      }  else if (state.busy && state.mode == 2 && current == '\n') {
-        state.buffer = U"";
-        state.busy = false;
-        state.mode = 0;
-        entries[i] = default_color;
-        last_entry = i;
-      } else if (!state.busy && language.singleLineComment.length() && hasEnding(state.buffer+current, language.singleLineComment)) {
-
-        entries[i  - (language.singleLineComment.length()-1)] = comment_color;
-        last_entry = i- (language.singleLineComment.length()-1);
-        state.busy = true;
-        state.mode = 2;
-        state.buffer = U"";
-      }else if(isNonChar(current) && !state.busy && state.buffer.length() && !state.wasReset) {
-
-        if (language.keyWords.count(state.buffer.getStrRef())) {
-
-          entries[state.start] = keyword_color;
-          entries[i] = default_color;
-          last_entry = i;
-          state.wasReset = true;
-          state.buffer = U"";
-        } else if (language.specialWords.count(state.buffer.getStrRef())) {
-          entries[state.start] = special_color;
-          entries[i] = default_color;
-          last_entry = i;
-          state.wasReset = true;
-          state.buffer = U"";
-        }
-
-      } else if (isNumber(current) && isNonChar(last) && !state.busy) {
-          state.mode = 6;
-          if(current == '0' && i < raw.length()-1 && (vec[i+1] == 'x' || vec[i+1] == 'X'))
-            state.mode = 7;
-          state.busy = true;
-          last_entry = i;
-          entries[i] = number_color;
-      } else if(!state.busy && isNonChar(last) && !isNonChar(current)) {
-        state.wasReset = false;
-        state.buffer = U"";
-        state.start = i;
+        continue;
       }
-
-      state.buffer += current;
-      last = current;
-      if(current == '\n') {
-        bool cont = false;
-        if(skip > 0) {
-          if(lCount == skip) {
-        if(!wasCached && skip != lastSkip) {
-          savedState = {state, last_entry == -1 ? default_color : entries[last_entry], true};
-          entries[i+1] = savedState.color;
-        } else if(wasCached  && savedState.loaded) {
-          entries[i+1] = savedState.color;
-          state = savedState.state;
+      bool escaped = i > 0 && cps[i - 1] == lang->escapeChar &&
+                     !(i > 1 && cps[i - 2] == lang->escapeChar);
+      if (!escaped && std::find(lang->stringPoints.begin(),
+                                lang->stringPoints.end(),
+                                current) != lang->stringPoints.end()) {
+        pushSpan(entry.spans, i, TokenKind::String);
+        state.mode = 1;
+        state.stringChar = current;
+        i++;
+        continue;
+      }
+      bool wordStart = i == 0 || isNonChar(cps[i - 1]);
+      if (wordStart && isNumber(current)) {
+        bool hexa = current == '0' && i + 1 < n &&
+                    (cps[i + 1] == 'x' || cps[i + 1] == 'X');
+        size_t end = i + 1;
+        while (end < n && !isNumberEnd(cps[end], hexa))
+          end++;
+        pushSpan(entry.spans, i, TokenKind::Number);
+        pushSpan(entry.spans, end, TokenKind::Default);
+        i = end;
+        continue;
+      }
+      if (wordStart && !isNonChar(current)) {
+        size_t end = i;
+        word.clear();
+        while (end < n && !isNonChar(cps[end]) &&
+               BracketIndex::bracketType(cps[end], open) == -1) {
+          appendUtf8(word, cps[end]);
+          end++;
         }
-
-
-          }
+        if (lang->keyWords.count(word)) {
+          pushSpan(entry.spans, i, TokenKind::Keyword);
+          pushSpan(entry.spans, end, TokenKind::Default);
+        } else if (lang->specialWords.count(word)) {
+          pushSpan(entry.spans, i, TokenKind::Special);
+          pushSpan(entry.spans, end, TokenKind::Default);
+        } else {
+          uint32_t id = internWord(word);
+          wordCounts[id]++;
+          entry.words.push_back({(int)i, (int)end, id});
         }
-      } else if (wasTriggered) {
-        wasTriggered = false;
-      }
-    }
-
-    //        std::cout << "lol: " << state.buffer << "end\n";
-    if(state.buffer.length()) {
-
-      if (language.keyWords.count(state.buffer.getStrRef())) {
-        entries[state.start] = keyword_color;
-        entries[i] = default_color;
-        state.wasReset = true;
-      } else if (language.specialWords.count(state.buffer.getStrRef())) {
-        entries[state.start] = special_color;
-        entries[i] = default_color;
-        state.wasReset = true;
-      }  else if (hasEnding(state.buffer, language.singleLineComment)) {
-
-        entries[offset(i) - language.singleLineComment.length()] = comment_color;
-        state.busy = true;
-        state.mode = 2;
-        state.buffer = U"";
-      }else if (hasEnding(state.buffer, language.multiLineComment.first)) {
-        entries[i] = comment_color;
-        state.buffer = U"";
-        state.busy = true;
-        state.mode = 3;
+        i = end;
+        continue;
       }
+      i++;
     }
-    int endIndex = entries.size();
-    lineIndex[y++] = std::pair<int, int>(startIndex, endIndex);
-
-    lastMax = maxLines;
-    cached = entries;
-    lastY = yPassed;
-    last_history_size = history_size;
-
-    wasCached = true;
-    lastSkip = skip;
-    return &cached;
-  }
-private:
-  bool nextIsValid(Utf8String str, int i) {
-    return i >= str.length()-1 || isNonChar(str[i+1]);
-  }
-  int offset(int i) {
-    return i+1;
-  }
-  bool hasEnding (Utf8String const &fullString, Utf8String const &ending) {
-    if (fullString.length() >= ending.length()) {
-      return fullString.endsWith(ending);
-    } else {
-      return false;
-    }
+    entry.exit = state;
+    brackets.setLine(y, std::move(found));
   }
 };
 
@@ -0,0 +1,145 @@
+#ifndef INSTANCE_STREAM_H
+#define INSTANCE_STREAM_H
+#include <cstddef>
+#include <cstdint>
+#include "shader.h"
+
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+typedef void(APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size,
+                                               const void *data,
+                                               GLbitfield flags);
+
+/*
+  The glyph instances of a frame are written into the next of a few regions
+  of one buffer, so a frame never waits for the draw of the previous one.
+  With ARB_buffer_storage the buffer stays mapped and a fence per region
+  tells when the GPU is done reading it, otherwise regions are mapped
+  unsynchronized and the buffer is orphaned when the ring wraps. Regions
+  are sized for the glyphs that fit on screen and grow when a frame has
+  more.
+*/
+class InstanceStream {
+public:
+  static const size_t REGIONS = 3;
+  void init() {
+    if (glfwExtensionSupported("GL_ARB_buffer_storage"))
+      bufferStorage =
+          (PFNGLBUFFERSTORAGEPROC)glfwGetProcAddress("glBufferStorage");
+    glGenBuffers(1, &vbo);
+  }
+  // cells is roughly how many glyphs fit on screen
+  void fit(size_t cells) {
+    size_t wanted = cells + cells / 4 + 256;
+    if (capacity < wanted || capacity > wanted * 4)
+      allocate(wanted);
+  }
+  /*
+    Room for count instances, nullptr if the buffer couldn't be mapped.
+    Only a successful begin is followed by end.
+  */
+  RenderChar *begin(size_t count) {
+    if (count > capacity)
+      allocate(count + count / 2);
+    region = (region + 1) % REGIONS;
+    if (persistent) {
+      if (fences[region]) {
+        while (glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                1000000000) == GL_TIMEOUT_EXPIRED)
+          ;
+        glDeleteSync(fences[region]);
+        fences[region] = 0;
+      }
+      return persistent + region * capacity;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    if (region == 0)
+      glBufferData(GL_ARRAY_BUFFER, bytes(), nullptr, GL_STREAM_DRAW);
+    return (RenderChar *)glMapBufferRange(
+        GL_ARRAY_BUFFER, sizeof(RenderChar) * region * capacity,
+        sizeof(RenderChar) * count,
+        GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT |
+            GL_MAP_INVALIDATE_RANGE_BIT);
+  }
+  // points the attributes of the bound vao at the region written last
+  void end() {
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    if (!persistent)
+      glUnmapBuffer(GL_ARRAY_BUFFER);
+    size_t base = sizeof(RenderChar) * region * capacity;
+    // pen position
+    glEnableVertexAttribArray(0);
+    glVertexAttribIPointer(0, 2, GL_SHORT, sizeof(RenderChar),
+                           (void *)(base + offsetof(RenderChar, x)));
+    glVertexAttribDivisor(0, 1);
+
+    // glyph slot
+    glEnableVertexAttribArray(1);
+    glVertexAttribIPointer(1, 1, GL_UNSIGNED_SHORT, sizeof(RenderChar),
+                           (void *)(base + offsetof(RenderChar, glyph)));
+    glVertexAttribDivisor(1, 1);
+
+    // palette index and flags
+    glEnableVertexAttribArray(2);
+    glVertexAttribIPointer(2, 2, GL_UNSIGNED_BYTE, sizeof(RenderChar),
+                           (void *)(base + offsetof(RenderChar, color)));
+    glVertexAttribDivisor(2, 1);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+  // after the draw reading the region, it's reused once the fence passed
+  void fence() {
+    if (persistent)
+      fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+
+private:
+  GLuint vbo = 0;
+  PFNGLBUFFERSTORAGEPROC bufferStorage = nullptr;
+  RenderChar *persistent = nullptr;
+  GLsync fences[REGIONS] = {};
+  size_t capacity = 0;
+  size_t region = REGIONS - 1;
+
+  size_t bytes() const { return sizeof(RenderChar) * capacity * REGIONS; }
+  void allocate(size_t instances) {
+    for (auto &fence : fences) {
+      if (fence)
+        glDeleteSync(fence);
+      fence = 0;
+    }
+    capacity = instances;
+    region = REGIONS - 1;
+    if (bufferStorage) {
+      // storage is immutable, a new size needs a new buffer
+      if (persistent) {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        persistent = nullptr;
+      }
+      glDeleteBuffers(1, &vbo);
+      glGenBuffers(1, &vbo);
+      glBindBuffer(GL_ARRAY_BUFFER, vbo);
+      GLbitfield flags =
+          GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      bufferStorage(GL_ARRAY_BUFFER, bytes(), nullptr, flags);
+      persistent =
+          (RenderChar *)glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes(), flags);
+      if (!persistent) {
+        bufferStorage = nullptr;
+        glDeleteBuffers(1, &vbo);
+        glGenBuffers(1, &vbo);
+      }
+    }
+    if (!persistent) {
+      glBindBuffer(GL_ARRAY_BUFFER, vbo);
+      glBufferData(GL_ARRAY_BUFFER, bytes(), nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+};
+
+#endif
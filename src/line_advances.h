@@ -0,0 +1,194 @@
+#ifndef LINE_ADVANCES_H
+#define LINE_ADVANCES_H
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "utf8String.h"
+
+/*
+  Prefix sums of the unscaled advances of a line. Lines longer than a chunk
+  of about CHUNK codepoints are split into chunks that have sums of their
+  own and keep their bytes, so an earlier revision of the same line hands
+  its unchanged chunks over and only the edited ones are measured again.
+  Looking up a column or a width is a search over the chunks and then one
+  within a chunk.
+*/
+class LineAdvances {
+public:
+  static constexpr size_t CHUNK = 4096;
+  struct Chunk {
+    std::string bytes;
+    // entry i is the width of the first i codepoints of the chunk
+    std::vector<float> prefix;
+  };
+  struct Piece {
+    std::shared_ptr<const Chunk> chunk;
+    size_t column;
+    // double, sums of long lines are past where floats hold every integer
+    double start;
+  };
+  // the sums of a line that fits in one chunk, it has no pieces then
+  std::vector<float> prefix;
+  std::vector<Piece> pieces;
+
+  size_t length() const { return columns; }
+  // width of the first column codepoints
+  float at(size_t column) const {
+    column = std::min(column, columns);
+    if (pieces.empty())
+      return prefix[column];
+    if (column == columns)
+      return total;
+    auto &piece = pieces[pieceOf(column)];
+    return piece.start + piece.chunk->prefix[column - piece.column];
+  }
+  /*
+    First column from from on whose width times scale is past x, length() + 1
+    if there is none. Widths are compared as at() returns them.
+  */
+  size_t columnPast(float x, size_t from, float scale = 1) const {
+    if (from > columns)
+      return columns + 1;
+    if (pieces.empty())
+      return search(prefix, 0, from, x, scale);
+    if (x < at(from) * scale)
+      return from;
+    if (!(x < (float)total * scale))
+      return columns + 1;
+    auto piece = std::upper_bound(
+        pieces.begin() + pieceOf(from), pieces.end(), x,
+        [scale](float x, const Piece &p) {
+          return x < (float)(p.start + p.chunk->prefix.back()) * scale;
+        });
+    return piece->column +
+           search(piece->chunk->prefix, piece->start,
+                  std::max(from, piece->column) - piece->column, x, scale);
+  }
+  /*
+    Measures line with advance, which gives the unscaled advance of a
+    codepoint. Chunks of previous, an earlier revision of the same line,
+    that are still there byte for byte at the start or the end are kept.
+  */
+  template <typename Advance>
+  void build(const Utf8String &line, const LineAdvances *previous,
+             Advance advance) {
+    const std::string &s = line.getStrRef();
+    std::vector<std::shared_ptr<const Chunk>> old;
+    if (previous) {
+      for (auto &piece : previous->pieces)
+        old.push_back(piece.chunk);
+    }
+    size_t front = 0, back = old.size();
+    size_t from = 0, to = s.size();
+    while (front < back && matches(s, from, to, *old[front], true))
+      from += old[front++]->bytes.size();
+    while (back > front && matches(s, from, to, *old[back - 1], false))
+      to -= old[--back]->bytes.size();
+    // an edit doesn't leave a small chunk behind, it takes a neighbour along
+    size_t count = codePointsIn(s, from, to);
+    while (from < to && count < CHUNK / 2 && (front > 0 || back < old.size())) {
+      if (back < old.size())
+        to += old[back++]->bytes.size();
+      else
+        from -= old[--front]->bytes.size();
+      count = codePointsIn(s, from, to);
+    }
+    size_t parts = from < to ? std::max<size_t>(1, count / CHUNK) : 0;
+    static thread_local std::vector<char32_t> codePoints;
+    prefix.clear();
+    pieces.clear();
+    columns = 0;
+    total = 0;
+    if (front == 0 && back == old.size() && parts <= 1) {
+      codePoints.clear();
+      Utf8String::decode(s.data(), s.size(), codePoints);
+      measure(codePoints, prefix, advance);
+      columns = codePoints.size();
+      total = prefix.back();
+      return;
+    }
+    pieces.reserve(front + parts + old.size() - back);
+    for (size_t i = 0; i < front; i++)
+      add(old[i]);
+    for (size_t i = 0; i < parts; i++) {
+      auto chunk = std::make_shared<Chunk>();
+      codePoints.clear();
+      size_t used = Utf8String::decode(
+          s.data() + from, to - from, codePoints,
+          i + 1 < parts ? (i + 1) * count / parts - i * count / parts
+                        : (size_t)-1);
+      // the last part also keeps bytes that don't decode
+      if (i + 1 == parts || used == 0)
+        used = to - from;
+      chunk->bytes.assign(s, from, used);
+      measure(codePoints, chunk->prefix, advance);
+      from += used;
+      add(std::move(chunk));
+      if (from == to)
+        break;
+    }
+    for (size_t i = back; i < old.size(); i++)
+      add(old[i]);
+  }
+  // bytes kept alive, shared chunks are counted for every line using them
+  size_t size() const {
+    size_t bytes = prefix.capacity() * sizeof(float) +
+                   pieces.capacity() * sizeof(Piece);
+    for (auto &piece : pieces)
+      bytes += piece.chunk->bytes.capacity() +
+               piece.chunk->prefix.capacity() * sizeof(float);
+    return bytes;
+  }
+
+private:
+  size_t columns = 0;
+  double total = 0;
+
+  size_t pieceOf(size_t column) const {
+    return std::upper_bound(pieces.begin(), pieces.end(), column,
+                            [](size_t column, const Piece &p) {
+                              return column < p.column;
+                            }) -
+           pieces.begin() - 1;
+  }
+  // first index from from on where start plus the sum is past x
+  static size_t search(const std::vector<float> &prefix, double start,
+                       size_t from, float x, float scale) {
+    return std::upper_bound(prefix.begin() + from, prefix.end(), x,
+                            [start, scale](float x, float p) {
+                              return x < (float)(start + p) * scale;
+                            }) -
+           prefix.begin();
+  }
+  template <typename Advance>
+  static void measure(const std::vector<char32_t> &codePoints,
+                      std::vector<float> &prefix, Advance &advance) {
+    prefix.resize(codePoints.size() + 1);
+    for (size_t i = 0; i < codePoints.size(); i++)
+      prefix[i + 1] = prefix[i] + advance(codePoints[i]);
+  }
+  void add(std::shared_ptr<const Chunk> chunk) {
+    size_t count = chunk->prefix.size() - 1;
+    float width = chunk->prefix.back();
+    pieces.push_back({std::move(chunk), columns, total});
+    columns += count;
+    total += width;
+  }
+  static bool matches(const std::string &s, size_t from, size_t to,
+                      const Chunk &chunk, bool atFront) {
+    size_t n = chunk.bytes.size();
+    if (n > to - from)
+      return false;
+    return s.compare(atFront ? from : to - n, n, chunk.bytes) == 0;
+  }
+  // lead bytes, the codepoints of valid utf8
+  static size_t codePointsIn(const std::string &s, size_t from, size_t to) {
+    size_t count = 0;
+    for (size_t i = from; i < to; i++)
+      count += ((uint8_t)s[i] & 0xc0) != 0x80;
+    return count;
+  }
+};
+#endif
@@ -22,6 +22,9 @@
 #include "state.h"
 #include "shader.h"
 #include "font_atlas.h"
+#include "render_cache.h"
+#include "row_builder.h"
+#include "damage.h"
 #include "cursor.h"
 #include "shaders.h"
 #include "highlighting.h"
@@ -70,6 +73,12 @@ void mouse_button_callback(GLFWwindow *window, int button, int action,
   }
 }
 
+void scroll_callback(GLFWwindow *window, double xoffset, double yoffset) {
+  if (gState == nullptr)
+    return;
+  gState->scrollBy(-(float)yoffset * gState->SCROLL_LINES);
+}
+
 void character_callback(GLFWwindow *window, unsigned int codepoint) {
   if (gState == nullptr)
     return;
@@ -377,6 +386,7 @@ int main(int argc, char **argv) {
   glfwSetKeyCallback(window, key_callback);
   glfwSetCharCallback(window, character_callback);
   glfwSetMouseButtonCallback(window, mouse_button_callback);
+  glfwSetScrollCallback(window, scroll_callback);
   glfwSetWindowFocusCallback(window, window_focus_callback);
   GLFWcursor *mouseCursor = glfwCreateStandardCursor(GLFW_IBEAM_CURSOR);
   glfwSetCursor(window, mouseCursor);
@@ -393,16 +403,14 @@ int main(int argc, char **argv) {
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
   state.init();
 
-  Shader text_shader(text_shader_vert, text_shader_frag, {});
-  text_shader.use();
-  Shader cursor_shader(cursor_shader_vert, cursor_shader_frag,
-                       {camera_shader_vert});
-  Shader selection_shader(selection_shader_vert, selection_shader_frag, {});
-  FontAtlas atlas(state.provider.fontPath, state.fontSize);
+  TextShader text_shader;
+  FontAtlas atlas(state.provider.fontPath, state.fontSize, false,
+                  state.provider.getGlyphCacheDir());
   for (auto &path : state.provider.extraFonts) {
     atlas.readFont(path, state.fontSize);
   }
   atlas.tabWidth = state.provider.tabWidth;
+  atlas.rasterizer->onReady = []() { glfwPostEmptyEvent(); };
   state.atlas = &atlas;
   if (atlas.errors.size()) {
     state.status += U" " + atlas.errors[0];
@@ -414,6 +422,15 @@ int main(int argc, char **argv) {
   int fontSize;
   float WIDTH = 0;
   float HEIGHT = 0;
+  RowCache rows;
+  FrameDamage damage;
+  FrameTarget target;
+  RowBuilder builder;
+  RowWorkers workers;
+  std::vector<RowJob> jobs;
+  std::vector<PlacedRow> placed;
+  // codepoints of the status and minibuffer text
+  std::vector<char32_t> codePoints;
   auto maxRenderWidth = 0;
   while (true) {
     if (glfwWindowShouldClose(window)) {
@@ -433,19 +450,22 @@ int main(int argc, char **argv) {
     }
     if (state.checkCommandRun())
       state.invalidateCache();
+    if (atlas.glyphsReady())
+      state.invalidateCache();
     if (state.cacheValid) {
-      glfwWaitEvents();
+      state.waitForEvents();
       continue;
     }
-    bool changed = false;
     if (HEIGHT != state.HEIGHT || WIDTH != state.WIDTH ||
         fontSize != state.fontSize) {
       WIDTH = state.WIDTH;
       fontSize = state.fontSize;
-      state.highlighter.wasCached = false;
       HEIGHT = state.HEIGHT;
-      changed = true;
+      // everything moves, draw the next frame completely
+      damage.invalidate();
     }
+    // new glyphs can change the line height, take them before measuring
+    atlas.beginFrame();
     const auto renderHeight = HEIGHT - state.atlas->atlas_height - 6;
     Cursor *cursor = state.cursor;
     if (state.vim && cursor->bind == nullptr && cursor->x > 0 &&
@@ -461,6 +481,7 @@ int main(int argc, char **argv) {
           maxRenderWidth, toOffset, renderHeight));
     else
       cursor->setBounds(renderHeight, toOffset);
+    state.stepScroll();
     if (maxRenderWidth != 0) {
       cursor->getContent(&atlas, maxRenderWidth, true, state.lineWrapping);
     }
@@ -468,7 +489,6 @@ int main(int argc, char **argv) {
     auto be_color = state.provider.colors.background_color;
     auto status_color = state.provider.colors.status_color;
     glClearColor(be_color.x, be_color.y, be_color.z, be_color.w);
-    glClear(GL_COLOR_BUFFER_BIT);
 
     std::vector<RenderChar> entries;
     Utf8String::const_iterator c;
@@ -482,16 +502,16 @@ int main(int argc, char **argv) {
                        : cursor->lines.size();
 
     auto maxLineAdvance = atlas.getAdvance(std::to_string(maxLines));
+    // the partly scrolled in line below the view is drawn too, clipped
+    const float scrollPixels =
+        state.lineWrapping ? 0 : cursor->scroll * toOffset;
+    const float textBottom = HEIGHT / 2 - renderHeight;
+    // boxes drawn below the text and above it, in the same draw
+    std::vector<RenderChar> under;
+    std::vector<RenderChar> over;
 
     if (state.provider.highlightLine == "full" ||
         (state.showLineNumbers && state.provider.highlightLine == "small")) {
-      selection_shader.use();
-      glBindVertexArray(state.highlight_vao);
-      auto color = state.provider.colors.highlight_color;
-      selection_shader.set4f("selection_color", color.x, color.y, color.z,
-                             color.w);
-      selection_shader.set2f("resolution", (float)WIDTH, (float)HEIGHT);
-      glBindBuffer(GL_ARRAY_BUFFER, state.highlight_vbo);
       SelectionEntry entry;
       float hWidth =
           (state.showLineNumbers && state.provider.highlightLine == "small")
@@ -510,18 +530,9 @@ int main(int argc, char **argv) {
                            ((cursor->y - cursor->skip) * toOffset)),
                  vec2f(hWidth, toOffset)};
       }
-
-      glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(SelectionEntry), &entry);
-
-      glBindBuffer(GL_ARRAY_BUFFER, 0);
-      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 6, 1);
+      atlas.renderRect(under, entry.pos, entry.size,
+                       state.provider.colors.highlight_color);
     }
-    text_shader.use();
-    text_shader.set2f("resolution", (float)WIDTH, (float)HEIGHT);
-    glActiveTexture(GL_TEXTURE0);
-    glBindVertexArray(state.vao);
-    glBindTexture(GL_TEXTURE_2D, atlas.texture_id);
-    glBindBuffer(GL_ARRAY_BUFFER, state.vbo);
     if (state.showLineNumbers) {
       if (state.lineWrapping) {
         auto heightRemaining = renderHeight;
@@ -549,7 +560,8 @@ int main(int argc, char **argv) {
       } else {
         int biggestLine = std::to_string(maxLines).length();
         auto maxLineAdvance = atlas.getAdvance(std::to_string(maxLines));
-        for (int i = start; i < maxLines; i++) {
+        int numbersEnd = std::min(maxLines + 1, (int)cursor->lines.size());
+        for (int i = start; i < numbersEnd; i++) {
           std::string value = std::to_string(i + 1);
           auto tAdvance = atlas.getAdvance(value);
           xpos += maxLineAdvance - tAdvance;
@@ -557,6 +569,7 @@ int main(int argc, char **argv) {
           for (cc = value.begin(); cc != value.end(); cc++) {
             entries.push_back(atlas.render(
                 *cc, xpos, ypos, state.provider.colors.line_number_color));
+            entries.back().flags |= RenderChar::SCROLLS;
             auto advance = atlas.getAdvance(*cc);
             xpos += advance;
             linesAdvance += advance;
@@ -567,148 +580,169 @@ int main(int argc, char **argv) {
       }
     }
     maxRenderWidth = (WIDTH / 2) - 20 - linesAdvance;
+    if (state.lineWrapping)
+      cursor->wrap.configure(atlas, maxRenderWidth * 2);
     auto skipNow = cursor->skip;
     auto *allLines =
         cursor->getContent(&atlas, maxRenderWidth, false, state.lineWrapping);
     state.reHighlight();
-    ypos = (-(HEIGHT / 2));
+    ypos = -(HEIGHT / 2) - (cursor->skip - cursor->prepareStart) * toOffset;
     xpos = -(int32_t)WIDTH / 2 + 20 + linesAdvance;
     cursor->setRenderStart(20 + linesAdvance, 15);
-    Vec4f color = state.provider.colors.default_color;
-    if (state.hasHighlighting) {
-      auto highlighter = state.highlighter;
-      int lineOffset = cursor->skip;
-      auto *colored = state.highlighter.get();
-      int cOffset = cursor->getTotalOffset();
-      int cxOffset = cursor->xOffset;
+    std::vector<SelectionEntry> occurrenceBoxes;
+    {
+      auto &highlighter = *state.highlighter;
+      auto *colors = &state.provider.colors;
+      int cxOffset = state.lineWrapping ? 0 : cursor->xOffset;
       auto heightRemaining = renderHeight;
-      //        std::cout << cxOffset << ":" << lineOffset << "\n";
+      const bool rainbow = state.provider.rainbowBrackets;
+      int depth =
+          rainbow ? highlighter.brackets.depthBefore(cursor->prepareStart) : 0;
+      const int64_t occurrence = state.occurrenceWord;
+      RowCache::FrameKey frameKey;
+      frameKey.width = WIDTH;
+      frameKey.height = HEIGHT;
+      frameKey.maxRenderWidth = maxRenderWidth;
+      frameKey.lineHeight = toOffset;
+      frameKey.scale = atlas.scale;
+      frameKey.layoutVersion = atlas.layoutVersion;
+      frameKey.lineWrapping = state.lineWrapping;
+      frameKey.highlighting = state.hasHighlighting;
+      frameKey.rainbow = rainbow;
+      frameKey.language = highlighter.language.get();
+      rows.beginFrame(frameKey, *colors);
+      builder.atlas = &atlas;
+      builder.colors = colors;
+      builder.maxRenderWidth = maxRenderWidth;
+      builder.lineHeight = toOffset;
+      builder.lineWrapping = state.lineWrapping;
+      builder.occurrence = occurrence;
+      builder.maxBoxes = State::MAX_OCCURRENCE_BOXES;
+      // rows are looked up in order, the changed ones are built afterwards
+      placed.clear();
+      jobs.clear();
+      if (state.lineWrapping)
+        cursor->wrap.reserve(allLines->size());
 
       for (size_t x = 0; x < allLines->size(); x++) {
-        auto content = (*allLines)[x].second;
-        auto hasColorIndex = highlighter.lineIndex.count(x + lineOffset);
-        if (content.length())
-          cOffset += cxOffset;
+        auto &content = (*allLines)[x];
+        const size_t lineIndex = x + cursor->prepareStart;
+        // rows of the band around the view are laid out but not drawn
+        const bool drawn =
+            lineIndex >= (size_t)cursor->skip &&
+            lineIndex <= (size_t)(cursor->skip + cursor->maxLines);
+        const std::vector<HighlightSpan> *spans =
+            state.hasHighlighting ? highlighter.getSpans(lineIndex) : nullptr;
+        const std::vector<BracketEntry> *lineBrackets =
+            rainbow && lineIndex < highlighter.brackets.lineCount()
+                ? &highlighter.brackets.getLine(lineIndex)
+                : nullptr;
+        const std::vector<WordSpan> *words =
+            occurrence != -1 ? highlighter.getWords(lineIndex) : nullptr;
+        RowKey key;
+        key.revision = cursor->lines[lineIndex].getRevision();
+        key.highlighted = spans != nullptr;
+        if (spans)
+          key.highlight = highlighter.lineCache[lineIndex].entry;
         else
-          cOffset += (*allLines)[x].first;
-        if (cxOffset > 0) {
-          if (hasColorIndex) {
-            auto entry = highlighter.lineIndex[x + lineOffset];
-            auto start = colored->begin();
-            std::advance(start, entry.first);
-            auto end = colored->begin();
-            std::advance(end, entry.second);
-            for (std::map<int, Vec4f>::iterator it = start; it != end; ++it) {
-              int xx = it->first;
-              if (xx >= cOffset)
-                break;
-              color = it->second;
+          key.color = colors->default_color;
+        key.xOffset = cxOffset;
+        key.depth = depth;
+        key.x = xpos;
+        // words reaching into the visible columns, found without a scan
+        size_t firstWord = 0;
+        if (words) {
+          firstWord = std::partition_point(words->begin(), words->end(),
+                                           [cxOffset](const WordSpan &word) {
+                                             return word.end <= cxOffset;
+                                           }) -
+                      words->begin();
+          const int lastColumn = cxOffset + content.length();
+          for (size_t i = firstWord;
+               i < words->size() && (*words)[i].start < lastColumn; i++) {
+            if ((*words)[i].id == occurrence) {
+              key.occurrence = occurrence;
+              break;
             }
           }
         }
-        if ((*colored).count(cOffset)) {
-          color = (*colored)[cOffset];
-        }
-        int charAdvance = 0;
-        for (c = content.begin(); c != content.end(); c++) {
-          if ((*colored).count(cOffset)) {
-            color = (*colored)[cOffset];
-          }
-
-          cOffset++;
-          charAdvance++;
-          if (*c != '\t')
-            entries.push_back(atlas.render(*c, xpos, ypos, color));
-          xpos += atlas.getAdvance(*c);
+        if (lineBrackets && lineBrackets->size())
+          depth += lineBrackets->back().depth +
+                   (lineBrackets->back().open ? 1 : -1);
+        auto &run = rows.row(key.revision);
+        if (rows.reusable(run, key, heightRemaining)) {
+          placed.push_back({&run, ypos, drawn, -1});
+          ypos += run.endY;
+          heightRemaining -= run.heightUsed;
+        } else {
+          rows.reset(run, key, ypos);
+          placed.push_back({&run, ypos, drawn, (int)jobs.size()});
+          RowJob job;
+          job.run = &run;
+          job.content = content;
+          job.spans = spans;
+          job.brackets = lineBrackets;
+          job.words = words;
+          job.firstWord = firstWord;
+          job.x = xpos;
+          job.y = ypos;
+          job.heightRemaining = heightRemaining;
           if (state.lineWrapping) {
-            if (xpos > (maxRenderWidth + atlas.getAdvance(*c))) {
-              if ((*colored).count(cOffset)) {
-                color = (*colored)[cOffset];
-              }
-              xpos = -maxRenderWidth;
+            job.breaks = &cursor->wrap.breaks(cursor->lines[lineIndex]);
+            // the rows a wrapped line takes are known before it's built
+            for (size_t i = 0; i < job.breaks->size() && heightRemaining > 0;
+                 i++) {
               ypos += toOffset;
               heightRemaining -= toOffset;
-              if (heightRemaining <= 0)
-                break;
-            }
-            continue;
-          }
-          if (xpos > (maxRenderWidth + atlas.getAdvance(*c)) &&
-              c != content.end()) {
-            int remaining = content.length() - (charAdvance);
-
-            if (remaining > 0) {
-              if (hasColorIndex) {
-                auto entry = highlighter.lineIndex[x + lineOffset];
-                auto start = colored->begin();
-                std::advance(start, entry.first);
-                auto end = colored->begin();
-                std::advance(end, entry.second);
-                for (std::map<int, Vec4f>::iterator it = start; it != end;
-                     ++it) {
-                  int xx = it->first;
-                  if (xx > cOffset + remaining)
-                    break;
-                  if (xx >= cOffset)
-                    color = it->second;
-                }
-              }
-              cOffset += remaining;
             }
-
-            break;
           }
+          jobs.push_back(job);
         }
+
         if (state.lineWrapping && heightRemaining <= 0)
           break;
-
         if (x < allLines->size() - 1) {
-          if ((*colored).count(cOffset)) {
-            color = (*colored)[cOffset];
-          }
-          cOffset++;
           xpos = -maxRenderWidth;
           ypos += toOffset;
         }
       }
-    } else {
-      auto heightRemaining = renderHeight;
-
-      for (size_t x = 0; x < allLines->size(); x++) {
-        auto content = (*allLines)[x].second;
-        for (c = content.begin(); c != content.end(); c++) {
-          if (*c != '\t')
-            entries.push_back(atlas.render(*c, xpos, ypos, color));
-          xpos += atlas.getAdvance(*c);
-          if (state.lineWrapping) {
-            if (xpos > (maxRenderWidth + atlas.getAdvance(*c))) {
-              xpos = -maxRenderWidth;
-              ypos += toOffset;
-              heightRemaining -= toOffset;
-              if (heightRemaining <= 0)
-                break;
-            }
-          }
-
-          if (xpos > maxRenderWidth + atlas.getAdvance(*c)) {
-            break;
-          }
+      builder.buildAll(jobs, workers);
+      // rows that met a glyph not loaded yet are built again here
+      if (std::any_of(jobs.begin(), jobs.end(),
+                      [](const RowJob &job) { return job.incomplete; })) {
+        for (auto &row : placed) {
+          if (row.job == -1 || !jobs[row.job].incomplete)
+            rows.touch(*row.run, atlas);
         }
-
-        if (state.lineWrapping && heightRemaining <= 0)
-          break;
-        if (x < allLines->size() - 1) {
-          xpos = -maxRenderWidth;
-          ypos += toOffset;
+        for (auto &job : jobs) {
+          if (!job.incomplete)
+            continue;
+          rows.reset(*job.run, job.run->key, job.y);
+          job.incomplete = false;
+          builder.build(job, true);
         }
       }
+      for (auto &row : placed) {
+        if (row.drawn)
+          rows.place(*row.run, row.y, atlas);
+        else
+          rows.keep(*row.run);
+        for (auto &box : row.run->boxes) {
+          if (!row.drawn ||
+              occurrenceBoxes.size() >= State::MAX_OCCURRENCE_BOXES)
+            break;
+          occurrenceBoxes.push_back(box);
+        }
+      }
+      rows.forget();
     }
     xpos = (-(int32_t)WIDTH / 2) + 15;
     ypos = (float)HEIGHT / 2 - toOffset - 10;
-    Utf8String status = state.status;
-    for (c = status.begin(); c != status.end(); c++) {
-      entries.push_back(atlas.render(*c, xpos, ypos, status_color));
-      xpos += atlas.getAdvance(*c);
+    codePoints.clear();
+    state.status.appendCodePoints(codePoints, 0, state.status.length());
+    for (char32_t cp : codePoints) {
+      entries.push_back(atlas.render(cp, xpos, ypos, status_color));
+      xpos += atlas.getAdvance(cp);
     }
     float statusAdvance = atlas.getAdvance(state.status);
     if (state.mode != 0 && state.mode != 32 ||
@@ -716,11 +750,12 @@ int main(int argc, char **argv) {
       // draw minibuffer
       xpos = (-(int32_t)WIDTH / 2) + 20 + statusAdvance;
       ypos = (float)HEIGHT / 2 - toOffset - 10;
-      Utf8String status = state.miniBuf;
-      for (c = status.begin(); c != status.end(); c++) {
-        entries.push_back(atlas.render(*c, xpos, ypos,
+      codePoints.clear();
+      state.miniBuf.appendCodePoints(codePoints, 0, state.miniBuf.length());
+      for (char32_t cp : codePoints) {
+        entries.push_back(atlas.render(cp, xpos, ypos,
                                        state.provider.colors.minibuffer_color));
-        xpos += atlas.getAdvance(*c);
+        xpos += atlas.getAdvance(cp);
       }
 
     } else {
@@ -733,77 +768,52 @@ int main(int argc, char **argv) {
       }
     }
 
-    glBindBuffer(GL_ARRAY_BUFFER, state.vbo);
-    glBufferSubData(
-        GL_ARRAY_BUFFER, 0, sizeof(RenderChar) * entries.size(),
-        &entries[0]); // be sure to use glBufferSubData and not glBufferData
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 6, (GLsizei)entries.size());
+    for (auto &box : occurrenceBoxes)
+      atlas.renderRect(under, box.pos, box.size,
+                       state.provider.colors.occurrence_color);
     if (state.focused) {
-      cursor_shader.use();
-      cursor_shader.set1f("cursor_width", 4);
-      cursor_shader.set1f("cursor_height", toOffset);
-      cursor_shader.set2f("resolution", (float)WIDTH, (float)HEIGHT);
-      cursor_shader.set4f("cursor_color",
-                          state.provider.colors.cursor_color_standard);
+      float cursorWidth = 4;
+      Vec4f cursorColor = state.provider.colors.cursor_color_standard;
       if (state.mode != 0 && state.mode != 32 ||
           (state.vim && state.vim->isCommandBufferActive())) {
         // use cursor for minibuffer
         float cursorX = -(int32_t)(WIDTH / 2) + 15 +
-                        (atlas.getAdvance(cursor->getCurrentAdvance())) + 5 +
+                        cursor->getCurrentAdvance(atlas) + 5 +
                         statusAdvance;
         float cursorY = (float)HEIGHT / 2 - 10;
-        cursor_shader.set2f("cursor_pos", cursorX, -cursorY);
-
-        glBindVertexArray(state.vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-        glBindVertexArray(0);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        atlas.renderRect(over, vec2f(cursorX, -cursorY),
+                         vec2f(cursorWidth, toOffset), cursorColor, 0);
       }
 
       if ((isSearchMode || state.mode == 0) &&
           (!state.vim || !state.vim->isCommandBufferActive())) {
+        if (state.vim && state.vim->getMode() != VimMode::INSERT) {
+          cursorWidth = atlas.getAdvance(' ');
+          cursorColor = state.provider.colors.cursor_color_vim;
+        }
+        Vec2f cursorPos;
         if (state.lineWrapping) {
           auto out = cursor->getPosLineWrapped(
               atlas, -maxRenderWidth, -(int32_t)(HEIGHT / 2) + 4 + toOffset,
               maxRenderWidth, toOffset, cursor->x, cursor->y);
-          if (state.vim) {
-            if (state.vim->getMode() == VimMode::INSERT) {
-              cursor_shader.set1f("cursor_width", 4);
-
-            } else {
-              cursor_shader.set1f("cursor_width", atlas.getAdvance(' '));
-              cursor_shader.set4f("cursor_color",
-                                  state.provider.colors.cursor_color_vim);
-            }
-          }
-          cursor_shader.set2f("cursor_pos", out.first, -out.second);
+          cursorPos = vec2f(out.first, -out.second);
         } else {
-          auto cAdvance =
-              (atlas.getAdvance(cursor->getCurrentAdvance(isSearchMode)));
+          auto cAdvance = cursor->getCurrentAdvance(atlas, isSearchMode);
           float cursorX = -(int32_t)(WIDTH / 2) + 15 + cAdvance + linesAdvance +
                           4 - cursor->xSkip;
           if (cursorX > WIDTH / 2)
             cursorX = (WIDTH / 2) - 3;
           float cursorY = -(int32_t)(HEIGHT / 2) + 4 +
                           (toOffset * ((cursor->y - cursor->skip) + 1));
-          if (state.vim) {
-            if (state.vim->getMode() == VimMode::INSERT) {
-              cursor_shader.set1f("cursor_width", 4);
-
-            } else {
-              cursor_shader.set1f("cursor_width", atlas.getAdvance(' '));
-              cursor_shader.set4f("cursor_color",
-                                  state.provider.colors.cursor_color_vim);
-            }
-          }
-          cursor_shader.set2f("cursor_pos", cursorX, -cursorY);
+          cursorPos = vec2f(cursorX, -cursorY);
         }
-
-        glBindVertexArray(state.vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-        glBindVertexArray(0);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        // scrolled away from the cursor
+        bool cursorVisible = state.lineWrapping ||
+                             (cursor->y >= cursor->skip &&
+                              cursor->y < cursor->skip + cursor->maxLines);
+        if (cursorVisible)
+          atlas.renderRect(over, cursorPos, vec2f(cursorWidth, toOffset),
+                           cursorColor);
       }
     }
     if (cursor->selection.active) {
@@ -820,12 +830,11 @@ int main(int argc, char **argv) {
             int smallerX = cursor->selection.getXSmaller();
             if (smallerX >= cursor->xOffset) {
 
-              float renderDistance = atlas.getAdvance(
-                  (*allLines)[yEnd - cursor->skip].second.substr(
-                      0, smallerX - cursor->xOffset));
-              float renderDistanceBigger = atlas.getAdvance(
-                  (*allLines)[yEnd - cursor->skip].second.substr(
-                      0, cursor->selection.getXBigger() - cursor->xOffset));
+              float renderDistance = atlas.advanceBetween(
+                  cursor->lines[yEnd], cursor->xOffset, smallerX);
+              float renderDistanceBigger =
+                  atlas.advanceBetween(cursor->lines[yEnd], cursor->xOffset,
+                                       cursor->selection.getXBigger());
               if (renderDistance < maxRenderWidth * 2) {
                 float start = ((float)HEIGHT / 2) - 5 -
                               (toOffset * ((yEnd - cursor->skip) + 1));
@@ -835,9 +844,9 @@ int main(int argc, char **argv) {
                            start),
                      vec2f(renderDistanceBigger - renderDistance, toOffset)});
               } else {
-                float renderDistanceBigger = atlas.getAdvance(
-                    (*allLines)[yEnd - cursor->skip].second.substr(
-                        0, cursor->selection.getXBigger() - cursor->xOffset));
+                float renderDistanceBigger =
+                    atlas.advanceBetween(cursor->lines[yEnd], cursor->xOffset,
+                                         cursor->selection.getXBigger());
                 float start = ((float)HEIGHT / 2) - 5 -
                               (toOffset * ((yEnd - cursor->skip) + 1));
                 selectionBoundaries.push_back(
@@ -850,9 +859,9 @@ int main(int argc, char **argv) {
                            toOffset)});
               }
             } else {
-              float renderDistanceBigger = atlas.getAdvance(
-                  (*allLines)[yEnd - cursor->skip].second.substr(
-                      0, cursor->selection.getXBigger() - cursor->xOffset));
+              float renderDistanceBigger =
+                  atlas.advanceBetween(cursor->lines[yEnd], cursor->xOffset,
+                                       cursor->selection.getXBigger());
               float start = ((float)HEIGHT / 2) - 5 -
                             (toOffset * ((yEnd - cursor->skip) + 1));
               selectionBoundaries.push_back(
@@ -868,9 +877,8 @@ int main(int argc, char **argv) {
               yStart <= (cursor->skip + cursor->maxLines) - 1) {
             int yEffective = cursor->selection.getYStart() - cursor->skip;
             int xStart = cursor->selection.getXStart();
-            float renderDistance =
-                atlas.getAdvance((*allLines)[yEffective].second.substr(
-                    0, xStart - cursor->xOffset));
+            float renderDistance = atlas.advanceBetween(
+                cursor->lines[yStart], cursor->xOffset, xStart);
             if (xStart >= cursor->xOffset) {
 
               if (renderDistance < (maxRenderWidth * 2)) {
@@ -903,9 +911,8 @@ int main(int argc, char **argv) {
             int yEffective = cursor->selection.getYEnd() - cursor->skip;
             int xStart = cursor->selection.getXEnd();
             if (xStart >= cursor->xOffset) {
-              float renderDistance =
-                  atlas.getAdvance((*allLines)[yEffective].second.substr(
-                      0, xStart - cursor->xOffset));
+              float renderDistance = atlas.advanceBetween(
+                  cursor->lines[yEnd], cursor->xOffset, xStart);
               if (renderDistance < (maxRenderWidth * 2)) {
                 if (yEnd < yStart) {
                   float start =
@@ -955,31 +962,91 @@ int main(int argc, char **argv) {
           }
         }
       }
-      if (selectionBoundaries.size()) {
-        selection_shader.use();
-        glBindVertexArray(state.sel_vao);
-        auto color = state.provider.colors.selection_color;
-        selection_shader.set4f("selection_color", color.x, color.y, color.z,
-                               color.w);
-        selection_shader.set2f("resolution", (float)WIDTH, (float)HEIGHT);
-        glBindBuffer(GL_ARRAY_BUFFER, state.sel_vbo);
-
-        glBufferSubData(GL_ARRAY_BUFFER, 0,
-                        sizeof(SelectionEntry) * selectionBoundaries.size(),
-                        &selectionBoundaries[0]);
+      for (auto &box : selectionBoundaries)
+        atlas.renderRect(over, box.pos, box.size,
+                         state.provider.colors.selection_color);
+    }
 
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 6,
-                              (GLsizei)selectionBoundaries.size());
+    // glyphs out of the packed range would pile up at its edge
+    entries.erase(
+        std::remove_if(entries.begin(), entries.end(),
+                       [](const RenderChar &r) { return r.clamped(); }),
+        entries.end());
+    text_shader.use();
+    text_shader.set2f(text_shader.resolution, (float)WIDTH, (float)HEIGHT);
+    text_shader.set1f(text_shader.scale, atlas.scale);
+    text_shader.set1f(text_shader.scroll, scrollPixels);
+    text_shader.set1f(text_shader.textBottom, textBottom);
+    text_shader.set1f(text_shader.lineHeight, toOffset);
+    glBindVertexArray(state.vao);
+    atlas.bindTextures();
+    atlas.flushMetrics();
+    if (atlas.palette.dirty) {
+      text_shader.set4fv(text_shader.palette, atlas.palette.colors);
+      atlas.palette.dirty = false;
+    }
+    int fbWidth, fbHeight;
+    glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
+    FrameDamage::Globals globals;
+    globals.width = fbWidth;
+    globals.height = fbHeight;
+    globals.worldHeight = HEIGHT;
+    globals.scale = atlas.scale;
+    globals.scroll = scrollPixels;
+    globals.textBottom = textBottom;
+    globals.lineHeight = toOffset;
+    globals.layoutVersion = atlas.layoutVersion;
+    globals.background = be_color;
+    // nothing kept from earlier frames, draw this one completely
+    if (!target.bind(fbWidth, fbHeight))
+      damage.invalidate();
+    RenderChar *out = nullptr;
+    size_t total = under.size() + rows.count + entries.size() + over.size();
+    if (damage.update(globals, rows.placed(), {&under, &entries, &over},
+                      atlas) &&
+        total) {
+      float cellWidth = std::max(1.0f, atlas.getAdvance(' '));
+      size_t cells = (size_t)(WIDTH / cellWidth + 1) *
+                     (size_t)(HEIGHT / std::max(1.0f, toOffset) + 1);
+      state.instances.fit(cells);
+      out = state.instances.begin(total);
+      if (out) {
+        // boxes below the text, the rows, line numbers and the status bar,
+        // then cursor and selection on top, each written where it goes
+        RenderChar *next = std::copy(under.begin(), under.end(), out);
+        builder.writeAll(rows, next, workers);
+        next = std::copy(entries.begin(), entries.end(), next + rows.count);
+        std::copy(over.begin(), over.end(), next);
+        state.instances.end();
+      } else {
+        damage.invalidate();
       }
     }
+    if (damage.bands.size()) {
+      // one draw, clipped to the rows spanning every band
+      auto span = target.span(damage.bands);
+      target.damage(span);
+      glEnable(GL_SCISSOR_TEST);
+      glScissor(0, span.first, fbWidth, span.second - span.first);
+      glClear(GL_COLOR_BUFFER_BIT);
+      if (out)
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 6, (GLsizei)total);
+      glDisable(GL_SCISSOR_TEST);
+      if (out)
+        state.instances.fence();
+    }
     glBindVertexArray(0);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    glfwSwapBuffers(window);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    if (damage.bands.size())
+      target.present(window, damage.bands);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
     state.cacheValid = true;
-    glfwWaitEvents();
+    if (atlas.needsRedraw() || state.scrolling)
+      state.invalidateCache();
+    state.waitForEvents();
   }
+  atlas.saveGlyphCaches();
+  FontDiscovery::get().shutdown();
   glfwTerminate();
   return 0;
 };
@@ -22,12 +22,7 @@
 #include <windows.h>
 #endif
 #ifdef __linux__
-#include <fontconfig/fontconfig.h>
-struct FontEntry {
-  std::string path;
-  std::string name;
-  std::string type;
-};
+#include "font_discovery.h"
 #endif
 
 namespace fs = std::filesystem;
@@ -56,6 +51,7 @@ public:
   bool allowTransparency = false;
   bool lineNumbers = true;
   bool lineWrapping = false;
+  bool rainbowBrackets = false;
   bool autoOpenCommandOut = false;
   bool commandHadOutput = false;
   std::string theme = "default";
@@ -171,6 +167,19 @@ public:
           configColors, "cursor_color", colors.cursor_color_standard);
       colors.cursor_color_vim = getVecOrDefault(
           configColors, "vim_cursor_color", colors.cursor_color_vim);
+      colors.occurrence_color = getVecOrDefault(
+          configColors, "occurrence_color", colors.occurrence_color);
+      if (configColors.contains("bracket_colors") &&
+          configColors["bracket_colors"].is_array()) {
+        std::vector<Vec4f> bracketColors;
+        for (auto &item : configColors["bracket_colors"]) {
+          json wrapped;
+          wrapped["color"] = item;
+          bracketColors.push_back(
+              getVecOrDefault(wrapped, "color", colors.default_color));
+        }
+        colors.bracket_colors = bracketColors;
+      }
       theme = name;
       return true;
     }
@@ -491,7 +500,7 @@ public:
       return def;
     return e;
   }
-  const std::string getDefaultFontPath() {
+  static const std::string getDefaultFontPath() {
 #ifdef _WIN32
     return (getDefaultFontDir() / "consola.ttf").generic_string();
 #endif
@@ -499,40 +508,16 @@ public:
     return (getDefaultFontDir() / "Monaco.ttf").generic_string();
 #endif
 #ifdef __linux__
-    FcConfig *config = FcInitLoadConfigAndFonts();
-    FcPattern *pat = FcPatternCreate();
-    FcObjectSet *objectSet = FcObjectSetBuild(FC_FAMILY, FC_STYLE, FC_LANG,
-                                              FC_FILE, FC_SPACING, nullptr);
-    FcFontSet *fSet = FcFontList(config, pat, objectSet);
-    std::vector<FontEntry> results;
-    for (int i = 0; fSet && i < fSet->nfont; i++) {
-      FcPattern *font = fSet->fonts[i];
-      FcChar8 *file, *family, *style;
-      int spacing;
-      if (FcPatternGetString(font, FC_FILE, 0, &file) == FcResultMatch &&
-          FcPatternGetInteger(font, FC_SPACING, 0, &spacing) == FcResultMatch &&
-          FcPatternGetString(font, FC_FAMILY, 0, &family) == FcResultMatch &&
-          FcPatternGetString(font, FC_STYLE, 0, &style) == FcResultMatch) {
-        if (spacing == 100)
-          results.push_back({std::string((const char *)file),
-                             std::string((const char *)family),
-                             std::string((const char *)style)});
-      }
-    }
-    if (fSet)
-      FcFontSetDestroy(fSet);
-    for (auto &entry : results) {
-      if (entry.name == "Hack" && entry.type == "Regular")
-        return entry.path;
-    }
-    for (auto &entry : results) {
-      if (entry.type == "Regular")
-        return entry.path;
+    fs::path *homeDir = getHomeFolder();
+    fs::path cacheFile;
+    if (homeDir) {
+      cacheFile = *homeDir / ".ledit" / "cache" / "fonts.json";
+      delete homeDir;
     }
-    return results[0].path;
+    return FontDiscovery::get().defaultFont(cacheFile);
 #endif
   }
-  const fs::path getDefaultFontDir() {
+  static const fs::path getDefaultFontDir() {
 // no idea how to do this differently
 #ifdef _WIN32
     return "C:\\Windows\\Fonts";
@@ -544,6 +529,15 @@ public:
     return "";
 #endif
   }
+  // rasterized glyphs, see GlyphCache
+  std::string getGlyphCacheDir() {
+    fs::path *homeDir = getHomeFolder();
+    if (!homeDir)
+      return "";
+    fs::path dir = *homeDir / ".ledit" / "cache";
+    delete homeDir;
+    return dir.generic_string();
+  }
   void setVimRemaps(json &in) {
     for (auto &entry : in.items()) {
       std::string k = entry.key();
@@ -551,9 +545,13 @@ public:
     }
   }
   void loadExtraLanguage(json &entry) {
-    if (!entry.is_object())
-      return;
     Language language;
+    if (parseLanguage(entry, language))
+      extraLanguages.push_back(language);
+  }
+  static bool parseLanguage(json &entry, Language &language) {
+    if (!entry.is_object())
+      return false;
     language.modeName = entry["mode_name"];
     if (entry.contains("key_words") && entry["key_words"].is_array()) {
       for (auto &word : entry["key_words"])
@@ -584,9 +582,7 @@ public:
       for (auto &word : entry["file_extensions"])
         language.fileExtensions.push_back(word);
     }
-    if (language.modeName.length() && language.fileExtensions.size()) {
-      extraLanguages.push_back(language);
-    }
+    return language.modeName.length() && language.fileExtensions.size();
   }
   void parseConfig(json *configRoot) {
 
@@ -616,6 +612,8 @@ public:
         getBoolOrDefault(*configRoot, "window_transparency", allowTransparency);
     lineNumbers = getBoolOrDefault(*configRoot, "line_numbers", lineNumbers);
     lineWrapping = getBoolOrDefault(*configRoot, "line_wrapping", lineWrapping);
+    rainbowBrackets =
+        getBoolOrDefault(*configRoot, "rainbow_brackets", rainbowBrackets);
     highlightLine =
         getStringOrDefault(*configRoot, "highlight_active_line", highlightLine);
   }
@@ -637,6 +635,7 @@ public:
     config["window_transparency"] = allowTransparency;
     config["use_spaces"] = useSpaces;
     config["line_wrapping"] = lineWrapping;
+    config["rainbow_brackets"] = rainbowBrackets;
     config["line_numbers"] = lineNumbers;
     config["highlight_active_line"] = highlightLine;
     config["auto_open_cmd_output"] = autoOpenCommandOut;
@@ -678,7 +677,7 @@ public:
   }
 
 private:
-  fs::path *getHomeFolder() {
+  static fs::path *getHomeFolder() {
 #ifdef _WIN32
     const char *home = getenv("USERPROFILE");
 #else
@@ -0,0 +1,212 @@
+#ifndef RENDER_CACHE_H
+#define RENDER_CACHE_H
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+#include "font_atlas.h"
+#include "highlighting.h"
+#include "shader.h"
+
+// what the instances of one row depend on besides the frame wide state
+struct RowKey {
+  uint64_t revision = 0;
+  bool highlighted = false;
+  LineState highlight;
+  int xOffset = 0;
+  int depth = 0;
+  // the occurrence id if the row contains it, otherwise -1
+  int64_t occurrence = -1;
+  Vec4f color = {0, 0, 0, 0};
+  float x = 0;
+  bool operator==(const RowKey &other) const {
+    return revision == other.revision && highlighted == other.highlighted &&
+           highlight == other.highlight && xOffset == other.xOffset &&
+           depth == other.depth && occurrence == other.occurrence &&
+           memcmp(&color, &other.color, sizeof(Vec4f)) == 0 && x == other.x;
+  }
+};
+struct RowRun {
+  RowKey key;
+  // ypos the instances were made at, a scrolled row is moved instead
+  float y = 0;
+  std::vector<RenderChar> instances;
+  std::vector<SelectionEntry> boxes;
+  // state after the row, the next one continues from it
+  float endX = 0;
+  float endY = 0;
+  float heightUsed = 0;
+  bool cut = false;
+  // different every time the instances are generated
+  uint64_t generation = 0;
+  // glyph slots drawn, sorted
+  const std::vector<uint16_t> &glyphSlots() const { return slots; }
+
+private:
+  friend class RowCache;
+  // glyph slots drawn, their pages are kept recently used
+  std::vector<uint16_t> slots;
+  uint64_t frame = 0;
+  // handed out by row() this frame
+  uint64_t claimed = 0;
+  bool fresh = true;
+};
+
+/*
+  Glyph instances of the visible lines, retained across frames. A row is
+  generated again only when its key changes, rows that just moved are
+  shifted, and the frame copies each run straight to its place in the
+  instance stream. Anything that affects every row, like the window size,
+  colors or the atlas layout, drops all of them.
+*/
+class RowCache {
+public:
+  struct FrameKey {
+    float width = 0;
+    float height = 0;
+    float maxRenderWidth = 0;
+    float lineHeight = 0;
+    float scale = 0;
+    uint64_t layoutVersion = 0;
+    bool lineWrapping = false;
+    bool highlighting = false;
+    bool rainbow = false;
+    const void *language = nullptr;
+    bool operator==(const FrameKey &other) const {
+      return width == other.width && height == other.height &&
+             maxRenderWidth == other.maxRenderWidth &&
+             lineHeight == other.lineHeight && scale == other.scale &&
+             layoutVersion == other.layoutVersion &&
+             lineWrapping == other.lineWrapping &&
+             highlighting == other.highlighting && rainbow == other.rainbow &&
+             language == other.language;
+    }
+  };
+  // instances placed this frame
+  size_t count = 0;
+  size_t generated = 0;
+  void beginFrame(const FrameKey &key, const EditorColors &colors) {
+    frame++;
+    count = 0;
+    generated = 0;
+    order.clear();
+    offsets.clear();
+    if (key == frameKey && sameColors(colors, this->colors))
+      return;
+    frameKey = key;
+    this->colors = colors;
+    rows.clear();
+  }
+  /*
+    The run for a line, copies of a line share the revision so a second
+    row with it gets its own run.
+  */
+  RowRun &row(uint64_t revision) {
+    for (uint64_t n = 0;; n++) {
+      auto &run = rows[revision + n * 0x9E3779B97F4A7C15ull];
+      if (run.claimed != frame) {
+        run.claimed = frame;
+        return run;
+      }
+    }
+  }
+  // whether run can be drawn as is, with heightRemaining left when wrapping
+  bool reusable(const RowRun &run, const RowKey &key,
+                float heightRemaining) const {
+    if (run.frame == 0 || !(run.key == key))
+      return false;
+    return !frameKey.lineWrapping ||
+           (!run.cut && heightRemaining - run.heightUsed > 0);
+  }
+  // call before generating the instances of a run again
+  void reset(RowRun &run, const RowKey &key, float y) {
+    run.key = key;
+    run.y = y;
+    run.generation = ++generations;
+    run.instances.clear();
+    run.boxes.clear();
+    run.cut = false;
+    run.fresh = true;
+  }
+  // puts run into this frame at ypos y, after the runs placed before it
+  void place(RowRun &run, float y, FontAtlas &atlas) {
+    touch(run, atlas);
+    if (y != run.y) {
+      float dy = y - run.y;
+      int16_t packed = RenderChar::pack(dy);
+      for (auto &instance : run.instances)
+        instance.y -= packed;
+      for (auto &box : run.boxes)
+        box.pos.y -= dy;
+      run.y = y;
+    }
+    offsets.push_back(count);
+    count += run.instances.size();
+    order.push_back(&run);
+  }
+  // the runs placed this frame in order
+  const std::vector<RowRun *> &placed() const { return order; }
+  // keeps run for later frames without drawing it, for rows near the view
+  void keep(RowRun &run) { settle(run); }
+  // keeps the pages of the glyphs of run, before loading more glyphs
+  void touch(RowRun &run, FontAtlas &atlas) {
+    settle(run);
+    for (auto slot : run.slots)
+      atlas.touchSlot(slot);
+  }
+  /*
+    Copies the i-th placed run to where it goes in the count instances at
+    out, runs can be copied on different threads.
+  */
+  void write(size_t i, RenderChar *out) const {
+    auto &instances = order[i]->instances;
+    std::copy(instances.begin(), instances.end(), out + offsets[i]);
+  }
+  // drops the rows neither placed nor kept this frame
+  void forget() {
+    for (auto it = rows.begin(); it != rows.end();) {
+      if (it->second.frame != frame)
+        it = rows.erase(it);
+      else
+        ++it;
+    }
+  }
+
+private:
+  std::unordered_map<uint64_t, RowRun> rows;
+  std::vector<RowRun *> order;
+  // where each placed run starts in the instances of the frame
+  std::vector<size_t> offsets;
+  FrameKey frameKey;
+  EditorColors colors;
+  uint64_t frame = 0;
+  uint64_t generations = 0;
+
+  // marks run as used this frame, a just generated one gets its slots
+  void settle(RowRun &run) {
+    run.frame = frame;
+    if (!run.fresh)
+      return;
+    run.fresh = false;
+    run.slots.clear();
+    for (auto &instance : run.instances) {
+      instance.flags |= RenderChar::SCROLLS;
+      run.slots.push_back(instance.glyph);
+    }
+    std::sort(run.slots.begin(), run.slots.end());
+    run.slots.erase(std::unique(run.slots.begin(), run.slots.end()),
+                    run.slots.end());
+    generated += run.instances.size();
+  }
+  static bool sameColors(const EditorColors &a, const EditorColors &b) {
+    return memcmp(&a, &b, offsetof(EditorColors, bracket_colors)) == 0 &&
+           a.bracket_colors.size() == b.bracket_colors.size() &&
+           (a.bracket_colors.empty() ||
+            memcmp(a.bracket_colors.data(), b.bracket_colors.data(),
+                   sizeof(Vec4f) * a.bracket_colors.size()) == 0);
+  }
+};
+
+#endif
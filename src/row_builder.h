@@ -0,0 +1,300 @@
+#ifndef ROW_BUILDER_H
+#define ROW_BUILDER_H
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "cursor.h"
+#include "font_atlas.h"
+#include "highlighting.h"
+#include "render_cache.h"
+
+// one row to generate, everything it reads is looked up beforehand
+struct RowJob {
+  RowRun *run = nullptr;
+  ViewLine content;
+  const std::vector<HighlightSpan> *spans = nullptr;
+  const std::vector<BracketEntry> *brackets = nullptr;
+  const std::vector<WordSpan> *words = nullptr;
+  // first word reaching into the visible columns
+  size_t firstWord = 0;
+  // columns starting a new row when wrapping
+  const std::vector<uint32_t> *breaks = nullptr;
+  float x = 0;
+  float y = 0;
+  float heightRemaining = 0;
+  // a glyph or color wasn't loaded yet, generate it again on the main thread
+  bool incomplete = false;
+};
+// a row of the frame in order, job is the index of its RowJob or -1
+struct PlacedRow {
+  RowRun *run;
+  float y;
+  bool drawn;
+  int job;
+};
+
+class RowWorkers;
+
+/*
+  Generates the instances and occurrence boxes of rows. On other threads
+  the atlas is only read, a row needing a glyph or color that isn't
+  loaded yet is left incomplete.
+*/
+class RowBuilder {
+public:
+  // fewer changed rows than this are built on the main thread
+  static const size_t PARALLEL_ROWS = 8;
+  // fewer instances than this are copied on the main thread
+  static const size_t PARALLEL_INSTANCES = 1 << 14;
+  // codepoints decoded at a time while building a row
+  static constexpr size_t DECODE_BATCH = 128;
+  FontAtlas *atlas = nullptr;
+  const EditorColors *colors = nullptr;
+  float maxRenderWidth = 0;
+  float lineHeight = 0;
+  bool lineWrapping = false;
+  int64_t occurrence = -1;
+  size_t maxBoxes = 0;
+  // loads the palette entries rows can use, before rows are built elsewhere
+  void registerColors() {
+    const TokenKind kinds[] = {TokenKind::Default, TokenKind::String,
+                               TokenKind::Keyword, TokenKind::Special,
+                               TokenKind::Number,  TokenKind::Comment};
+    for (auto kind : kinds)
+      atlas->loadColor(Highlighter::colorFor(kind, colors));
+    for (auto &color : colors->bracket_colors)
+      atlas->loadColor(color);
+  }
+  void build(RowJob &job, bool mainThread) {
+    static thread_local std::vector<char32_t> codePoints;
+    auto &run = *job.run;
+    const auto *spans = job.spans;
+    const auto *brackets = job.brackets;
+    const auto *words = job.words;
+    float xpos = job.x;
+    float ypos = job.y;
+    float heightRemaining = job.heightRemaining;
+    size_t column = run.key.xOffset;
+    Vec4f color = colors->default_color;
+    size_t spanIndex = 0;
+    if (spans && spans->size()) {
+      spanIndex = Highlighter::spanAt(*spans, (int)column);
+      color = Highlighter::colorFor((*spans)[spanIndex].kind, colors);
+    }
+    size_t wordIndex = job.firstWord;
+    bool boxOpen = false;
+    int lineDepth = run.key.depth;
+    size_t bracketIndex = 0;
+    if (brackets && column > 0) {
+      bracketIndex = std::partition_point(brackets->begin(), brackets->end(),
+                                          [column](const BracketEntry &entry) {
+                                            return (size_t)entry.x < column;
+                                          }) -
+                     brackets->begin();
+      if (bracketIndex < brackets->size())
+        lineDepth += (*brackets)[bracketIndex].depth;
+      else if (bracketIndex > 0)
+        lineDepth += brackets->back().depth + (brackets->back().open ? 1 : -1);
+    }
+    size_t breakIndex = 0;
+    // decoded a batch at a time, a row usually ends well before its slice
+    const std::string &bytes = job.content.line->getStrRef();
+    size_t offset = job.content.line->byteOffset(job.content.begin);
+    size_t remaining =
+        job.content.end > job.content.begin ? job.content.length() : 0;
+    size_t decoded = 0;
+    codePoints.clear();
+    for (;;) {
+      if (decoded == codePoints.size()) {
+        codePoints.clear();
+        decoded = 0;
+        offset += Utf8String::decode(bytes.data() + offset,
+                                     bytes.size() - offset, codePoints,
+                                     std::min(remaining, DECODE_BATCH));
+        if (codePoints.empty())
+          break;
+        remaining -= codePoints.size();
+      }
+      char32_t cp = codePoints[decoded++];
+      if (spans && spanIndex + 1 < spans->size() &&
+          (size_t)(*spans)[spanIndex + 1].start <= column) {
+        while (spanIndex + 1 < spans->size() &&
+               (size_t)(*spans)[spanIndex + 1].start <= column)
+          spanIndex++;
+        color = Highlighter::colorFor((*spans)[spanIndex].kind, colors);
+      }
+      Vec4f charColor = color;
+      if (brackets && bracketIndex < brackets->size() &&
+          (size_t)(*brackets)[bracketIndex].x == column) {
+        bool open = (*brackets)[bracketIndex++].open;
+        if (!open)
+          lineDepth--;
+        charColor = Highlighter::bracketColorFor(lineDepth, colors);
+        if (open)
+          lineDepth++;
+      }
+      RenderChar instance;
+      float advance;
+      if (mainThread) {
+        instance = atlas->render(cp, xpos, ypos, charColor);
+        advance = atlas->getAdvance(cp);
+      } else if (!atlas->renderKnown(cp, xpos, ypos, charColor, instance,
+                                     advance)) {
+        job.incomplete = true;
+        return;
+      }
+      if (run.key.occurrence != -1) {
+        while (wordIndex < words->size() &&
+               (size_t)(*words)[wordIndex].end <= column)
+          wordIndex++;
+        if (wordIndex < words->size() &&
+            (size_t)(*words)[wordIndex].start <= column &&
+            (*words)[wordIndex].id == occurrence) {
+          float boxY = -ypos - 5 - lineHeight;
+          if (boxOpen && run.boxes.back().pos.y == boxY) {
+            run.boxes.back().size.x += advance;
+          } else if (run.boxes.size() < maxBoxes) {
+            run.boxes.push_back(
+                {vec2f(xpos, boxY), vec2f(advance, lineHeight)});
+            boxOpen = true;
+          }
+        } else {
+          boxOpen = false;
+        }
+      }
+      column++;
+      if (cp != '\t' && !instance.clamped())
+        run.instances.push_back(instance);
+      xpos += advance;
+      if (lineWrapping) {
+        if (breakIndex < job.breaks->size() &&
+            column == (*job.breaks)[breakIndex]) {
+          breakIndex++;
+          xpos = -maxRenderWidth;
+          ypos += lineHeight;
+          heightRemaining -= lineHeight;
+          if (heightRemaining <= 0)
+            break;
+        }
+        continue;
+      }
+      if (xpos > maxRenderWidth + advance)
+        break;
+    }
+    run.endX = xpos;
+    run.endY = ypos - job.y;
+    run.heightUsed = job.heightRemaining - heightRemaining;
+    run.cut = lineWrapping && heightRemaining <= 0;
+  }
+  void buildAll(std::vector<RowJob> &jobs, RowWorkers &workers);
+  // copies the rows placed in rows to out, which has room for rows.count
+  void writeAll(const RowCache &rows, RenderChar *out, RowWorkers &workers);
+};
+
+/*
+  Threads building the rows of a frame along with the main thread. Rows
+  are taken one at a time, so a few long lines don't hold up the rest.
+*/
+class RowWorkers {
+public:
+  RowWorkers() {
+    unsigned count = std::thread::hardware_concurrency();
+    count = count > 2 ? count - 1 : 0;
+    if (count > MAX_WORKERS)
+      count = MAX_WORKERS;
+    for (unsigned i = 0; i < count; i++)
+      workers.emplace_back([this]() { loop(); });
+  }
+  ~RowWorkers() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+  // calls work for every index below count and returns once all are done
+  void run(size_t count, const std::function<void(size_t)> &work) {
+    if (workers.empty() || count < 2) {
+      for (size_t i = 0; i < count; i++)
+        work(i);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      this->work = &work;
+      this->count = count;
+      next = 0;
+      pending = workers.size();
+      round++;
+    }
+    wake.notify_all();
+    drain();
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return pending == 0; });
+    this->work = nullptr;
+  }
+
+private:
+  static const unsigned MAX_WORKERS = 7;
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const std::function<void(size_t)> *work = nullptr;
+  size_t count = 0;
+  std::atomic<size_t> next{0};
+  size_t pending = 0;
+  uint64_t round = 0;
+  bool stopping = false;
+
+  void drain() {
+    for (size_t i = next++; i < count; i = next++)
+      (*work)(i);
+  }
+  void loop() {
+    uint64_t seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&]() { return stopping || round != seen; });
+        if (stopping)
+          return;
+        seen = round;
+      }
+      drain();
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--pending == 0)
+        done.notify_one();
+    }
+  }
+};
+
+inline void RowBuilder::buildAll(std::vector<RowJob> &jobs,
+                                 RowWorkers &workers) {
+  if (jobs.size() < PARALLEL_ROWS) {
+    for (auto &job : jobs)
+      build(job, true);
+    return;
+  }
+  registerColors();
+  workers.run(jobs.size(), [&](size_t i) { build(jobs[i], false); });
+}
+inline void RowBuilder::writeAll(const RowCache &rows, RenderChar *out,
+                                 RowWorkers &workers) {
+  size_t count = rows.placed().size();
+  if (rows.count < PARALLEL_INSTANCES) {
+    for (size_t i = 0; i < count; i++)
+      rows.write(i, out);
+    return;
+  }
+  workers.run(count, [&](size_t i) { rows.write(i, out); });
+}
+
+#endif
@@ -1,21 +1,37 @@
 #ifndef SHADER_H
 #define SHADER_H
 #include "utils.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 struct CharacterEntry {
 
-  float width;
-  float height;
-  float top;
-  float left;
-  float advance;
-  float advanceY;
-  float offset;
+  float width = 0;
+  float height = 0;
+  float top = 0;
+  float left = 0;
+  float advance = 0;
+  float advanceY = 0;
+  // one byte per pixel for SDF glyphs, RGBA for color glyphs
   uint8_t *data = nullptr;
-  int xPos;
-  char32_t c;
-  bool hasColor;
+  int xPos = 0;
+  int yPos = 0;
+  int page = 0;
+  char32_t c = 0;
+  bool hasColor = false;
+  // quad relative to the pen position in atlas pixels and UV rect
+  Vec2f quadOffset = {0, 0};
+  Vec2f quadSize = {0, 0};
+  Vec2f uvPos = {0, 0};
+  Vec2f uvSize = {0, 0};
+  // where the shader finds the metrics above, 0 is an empty glyph
+  uint16_t slot = 0;
   ~CharacterEntry() {
     if (data != nullptr) {
       delete[] data;
@@ -29,31 +45,113 @@ struct CharacterEntry {
   }
 
   CharacterEntry &operator=(const CharacterEntry &other) {
+    if (this == &other)
+      return *this;
     width = other.width;
     height = other.height;
     top = other.top;
     left = other.left;
     advance = other.advance;
     advanceY = other.advanceY;
-    offset = other.offset;
     xPos = other.xPos;
+    yPos = other.yPos;
+    page = other.page;
     c = other.c;
     hasColor = other.hasColor;
-    if (other.data != nullptr && data == nullptr) {
-      this->data = new uint8_t[(int)width * (int)height * 4];
-      memcpy(data, other.data, (int)width * (int)height * 4);
+    quadOffset = other.quadOffset;
+    quadSize = other.quadSize;
+    uvPos = other.uvPos;
+    uvSize = other.uvSize;
+    slot = other.slot;
+    delete[] data;
+    data = nullptr;
+    if (other.data != nullptr) {
+      size_t size = (int)width * (int)height * (hasColor ? 4 : 1);
+      this->data = new uint8_t[size];
+      memcpy(data, other.data, size);
     }
     return *this;
   }
 };
+/*
+  One glyph instance. The pen position is in quarter pixels, the quad, UVs
+  and page come from the metrics of the glyph slot and the color from the
+  palette, both looked up in the vertex shader. A RECT instance is a solid
+  box instead, glyph holds its width in quarter pixels and the upper bits
+  of flags its height in lines.
+*/
 struct RenderChar {
-  Vec2f pos;
-  Vec2f size;
-  Vec2f uv_pos;
-  Vec2f uv_size;
-  Vec4f fg_color;
-  Vec4f bg_color;
-  float hasColor;
+  static constexpr float SUBPIXELS = 4;
+  int16_t x = 0;
+  int16_t y = 0;
+  uint16_t glyph = 0;
+  uint8_t color = 0;
+  uint8_t flags = 0;
+  // moves with the scroll offset and is clipped to the text area
+  static constexpr uint8_t SCROLLS = 1;
+  static constexpr uint8_t RECT = 2;
+  static constexpr int RECT_LINES_SHIFT = 2;
+  static constexpr int MAX_RECT_LINES = 63;
+  // how far from the center of the window a position can be packed, pixels
+  static constexpr float MAX_POSITION = INT16_MAX / SUBPIXELS;
+  static bool fits(float v) { return v >= -MAX_POSITION && v <= MAX_POSITION; }
+  // positions past MAX_POSITION are clamped, see clamped()
+  static int16_t pack(float v) {
+    long scaled = std::lrint(v * SUBPIXELS);
+    if (scaled > INT16_MAX)
+      return INT16_MAX;
+    if (scaled < INT16_MIN)
+      return INT16_MIN;
+    return (int16_t)scaled;
+  }
+  // a position was out of range, the glyph would be drawn at its edge
+  bool clamped() const {
+    return x == INT16_MAX || x == INT16_MIN || y == INT16_MAX ||
+           y == INT16_MIN;
+  }
+};
+// colors instances refer to by index, uploaded as a uniform array
+class ColorPalette {
+public:
+  static const size_t MAX_COLORS = 64;
+  std::vector<Vec4f> colors;
+  bool dirty = true;
+  // -1 once the palette is full
+  int index(Vec4f color) {
+    if (last < colors.size() && same(colors[last], color))
+      return last;
+    for (size_t i = 0; i < colors.size(); i++) {
+      if (same(colors[i], color)) {
+        last = i;
+        return i;
+      }
+    }
+    if (colors.size() == MAX_COLORS)
+      return -1;
+    colors.push_back(color);
+    dirty = true;
+    last = colors.size() - 1;
+    return last;
+  }
+  // like index but without adding color, safe to call from several threads
+  int find(Vec4f color) const {
+    for (size_t i = 0; i < colors.size(); i++) {
+      if (same(colors[i], color))
+        return i;
+    }
+    return -1;
+  }
+  void clear() {
+    colors.clear();
+    last = 0;
+    dirty = true;
+  }
+
+private:
+  size_t last = 0;
+  static bool same(const Vec4f &a, const Vec4f &b) {
+    return memcmp(&a, &b, sizeof(Vec4f)) == 0;
+  }
 };
 struct SelectionEntry {
   Vec2f pos;
@@ -79,23 +177,56 @@ public:
     }
     glLinkProgram(pid);
     checkCompileErrors(pid, "PROGRAM");
+    cacheLocations();
   }
-  void set2f(std::string name, float x, float y) {
-    glUniform2f(glGetUniformLocation(pid, name.c_str()), x, y);
+  /*
+    Where the uniform name is, as found when linking. -1 for names the
+    linker dropped, setting those is a no-op.
+  */
+  GLint location(const std::string &name) const {
+    auto it = locations.find(name);
+    return it == locations.end() ? -1 : it->second;
   }
-  void set4f(std::string name, float x, float y, float z, float w) {
-    glUniform4f(glGetUniformLocation(pid, name.c_str()), x, y, z, w);
+  void set2f(GLint location, float x, float y) {
+    glUniform2f(location, x, y);
   }
-   void set4f(std::string name, Vec4f in) {
-    glUniform4f(glGetUniformLocation(pid, name.c_str()), in.x, in.y, in.z, in.w);
+  void set4f(GLint location, float x, float y, float z, float w) {
+    glUniform4f(location, x, y, z, w);
   }
-  void set1f(std::string name, float v) {
-    glUniform1f(glGetUniformLocation(pid, name.c_str()), v);
+  void set4f(GLint location, Vec4f in) {
+    glUniform4f(location, in.x, in.y, in.z, in.w);
+  }
+  void set1f(GLint location, float v) { glUniform1f(location, v); }
+  void set1i(GLint location, int v) { glUniform1i(location, v); }
+  void set4fv(GLint location, const std::vector<Vec4f> &values) {
+    if (values.size())
+      glUniform4fv(location, (GLsizei)values.size(), &values[0].x);
   }
 
   void use() { glUseProgram(pid); }
 
 private:
+  std::unordered_map<std::string, GLint> locations;
+
+  // every active uniform, arrays under their name without the [0]
+  void cacheLocations() {
+    GLint count = 0;
+    GLint maxLength = 0;
+    glGetProgramiv(pid, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(pid, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    std::vector<GLchar> name(std::max(maxLength, 1));
+    for (GLint i = 0; i < count; i++) {
+      GLsizei length = 0;
+      GLint size = 0;
+      GLenum type = 0;
+      glGetActiveUniform(pid, i, (GLsizei)name.size(), &length, &size, &type,
+                         name.data());
+      std::string key(name.data(), length);
+      if (key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0)
+        key.resize(key.size() - 3);
+      locations[key] = glGetUniformLocation(pid, name.data());
+    }
+  }
   GLuint compileSimple(GLuint type, std::string path) {
     std::string content = path;
     auto id = glCreateShader(type);
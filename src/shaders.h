@@ -2,38 +2,68 @@
 #define SHADER_CONSTANT_H
 
 #include <string>
+#include "shader.h"
 
 const std::string text_shader_vert = R"(
 #version 330 core
 
 
-layout(location = 0) in vec2 pos;
-layout(location = 1) in vec2 size;
-layout(location = 2) in vec2 uv_pos;
-layout(location = 3) in vec2 uv_size;
-layout(location = 4) in vec4 fg_color;
-layout(location = 5) in vec4 bg_color;
-layout(location = 6) in float hColor;
+layout(location = 0) in ivec2 pos;
+layout(location = 1) in uint glyph;
+layout(location = 2) in uvec2 style;
 
 out vec2 uv;
 out vec2 glyph_uv_pos;
 out vec2 glyph_uv_size;
 out vec4 glyph_fg_color;
-out vec4 glyph_bg_color;
 out float hasColor;
+out float glyph_page;
+out float clip_y;
 uniform vec2 resolution;
+uniform float scale;
+// pixels the text is scrolled up and the bottom of the text area
+uniform float scroll;
+uniform float text_bottom;
+uniform float line_height;
+// three texels per glyph slot: quad offset and size, uv rect, page and color
+uniform samplerBuffer glyphs;
+uniform vec4 palette[64];
+const float SUBPIXELS = 4.0;
 vec2 camera_project(vec2 point) {
 return 2* (point) * (1 / resolution);
 }
 
 void main() {
     uv = vec2(float(gl_VertexID & 1), float((gl_VertexID >> 1) & 1));
-    gl_Position = vec4(camera_project(uv * (size) + (pos)), 0.0, 1.0);
-    glyph_uv_pos = uv_pos;
-    glyph_uv_size = uv_size;
-    glyph_fg_color = fg_color;
-    glyph_bg_color = vec4(0.0);
-    hasColor = hColor;
+    vec2 point;
+    glyph_fg_color = palette[style.x];
+    if ((style.y & 2u) != 0u) {
+        // solid box, width in quarter pixels and height in lines
+        vec2 size = vec2(float(glyph) / SUBPIXELS,
+                         float(style.y >> 2) * line_height);
+        point = uv * size + vec2(pos) / SUBPIXELS;
+        glyph_uv_pos = vec2(0.0);
+        glyph_uv_size = vec2(0.0);
+        glyph_page = 0.0;
+        hasColor = 2.0;
+    } else {
+        int base = int(glyph) * 3;
+        vec4 quad = texelFetch(glyphs, base);
+        vec4 rect = texelFetch(glyphs, base + 1);
+        vec4 extra = texelFetch(glyphs, base + 2);
+        vec2 origin = vec2(pos) / SUBPIXELS + vec2(quad.x, -quad.y) * scale;
+        point = uv * (quad.zw * scale) + origin;
+        glyph_uv_pos = rect.xy;
+        glyph_uv_size = rect.zw;
+        hasColor = extra.y;
+        glyph_page = extra.x;
+    }
+    clip_y = 1.0;
+    if ((style.y & 1u) != 0u) {
+        point.y += scroll;
+        clip_y = point.y - text_bottom;
+    }
+    gl_Position = vec4(camera_project(point), 0.0, 1.0);
 }
 
 )";
@@ -41,20 +71,26 @@ void main() {
 const std::string text_shader_frag = R"(
 #version 330 core
 
-uniform sampler2D font;
+uniform sampler2DArray font;
+uniform sampler2DArray colorFont;
 
 in vec2 uv;
 in vec2 glyph_uv_pos;
 in vec2 glyph_uv_size;
 in vec4 glyph_fg_color;
-in vec4 glyph_bg_color;
 in float hasColor;
+in float glyph_page;
+in float clip_y;
 
 out vec4 color;
 void main() {
-     vec2 t = glyph_uv_pos + glyph_uv_size * uv;
-     if(hasColor > 0.5) {
-          color = texture(font, t);
+     if (clip_y < 0.0)
+          discard;
+     vec3 t = vec3(glyph_uv_pos + glyph_uv_size * uv, glyph_page);
+     if (hasColor > 1.5) {
+          color = glyph_fg_color;
+     } else if(hasColor > 0.5) {
+          color = texture(colorFont, t);
      } else {
           float d = texture(font, t).r;
           float aaf = fwidth(d);
@@ -66,87 +102,25 @@ void main() {
 }
 )";
 
-const std::string camera_shader_vert = R"(#version 330 core
-uniform vec2 resolution;
- float camera_scale;
- vec2 camera_pos;
-
-vec2 camera_project(vec2 point)
-{
-
-  camera_scale = 1.0;
-  camera_pos = vec2(0);
-  return 2 * (point - camera_pos) * camera_scale / resolution;
-}
-)";
-
-const std::string cursor_shader_vert = R"(
-#version 330 core
-
-uniform vec2 resolution;
-uniform vec2 cursor_pos;
-uniform vec4 cursor_color;
-
-uniform float cursor_width;
-uniform float cursor_height;
-
-out vec2 uv;
-out vec4 color;
-
-vec2 camera_project(vec2 point);
-
-void main() {
-    uv = vec2(float(gl_VertexID & 1),
-              float((gl_VertexID >> 1) & 1));
-    color = cursor_color;
-    gl_Position = vec4(
-        camera_project(uv * vec2(cursor_width, cursor_height) + cursor_pos),
-        0.0,
-        1.0);
-}
-
-)";
-
-const std::string cursor_shader_frag = R"(
-
-
-#version 330 core
-
-in vec2 uv;
-in vec4 color;
-
-out vec4 diffuseColor;
-void main() {
-    //diffuseColor = vec4(0.8,0.8,1.0,1.0);
-    diffuseColor = color;
-}
-
-)";
-
-const std::string selection_shader_vert = R"(
-#version 330 core
-uniform vec2 resolution;
-layout(location = 0) in vec2 position;
-layout(location = 1) in vec2 size;
-vec2 camera_project(vec2 point) {
-return 2* (point) * (1 / resolution);
-}
-
-void main() {
-vec2 uv = vec2(float(gl_VertexID & 1),
-              float((gl_VertexID >> 1) & 1));
-
-   gl_Position = vec4(camera_project(uv * size + position), 0.0f, 1.0f);
-}
-)";
-
-const std::string selection_shader_frag = R"(
-#version 330 core
-uniform vec4 selection_color;
-out vec4 color;
-void main() {
-  color = selection_color;
-}
-)";
+// the text shader, with the uniforms set every frame looked up
+class TextShader : public Shader {
+public:
+  const GLint resolution;
+  const GLint scale;
+  const GLint scroll;
+  const GLint textBottom;
+  const GLint lineHeight;
+  const GLint palette;
+  TextShader()
+      : Shader(text_shader_vert, text_shader_frag, {}),
+        resolution(location("resolution")), scale(location("scale")),
+        scroll(location("scroll")), textBottom(location("text_bottom")),
+        lineHeight(location("line_height")), palette(location("palette")) {
+    use();
+    set1i(location("font"), 0);
+    set1i(location("colorFont"), 1);
+    set1i(location("glyphs"), 2);
+  }
+};
 
 #endif
@@ -10,6 +10,7 @@
 #include "shader.h"
 #include "cursor.h"
 #include "highlighting.h"
+#include "instance_stream.h"
 #include "languages.h"
 #include "providers.h"
 #include "u8String.h"
@@ -20,6 +21,7 @@ void register_vim_commands(Vim &vim, State &state);
 struct CursorEntry {
   Cursor cursor;
   std::string path;
+  Highlighter highlighter;
 };
 struct ReplaceBuffer {
   Utf8String search = U"";
@@ -27,17 +29,17 @@ struct ReplaceBuffer {
 };
 class State {
 public:
-  GLuint vao, vbo;
+  GLuint vao;
+  InstanceStream instances;
   bool focused = true;
   bool exitFlag = false;
   bool exitLoop = false;
   bool cacheValid = false;
-  GLuint sel_vao, sel_vbo;
-  GLuint highlight_vao, highlight_vbo;
+  static const size_t MAX_OCCURRENCE_BOXES = 512;
   Cursor *cursor;
   std::vector<CursorEntry *> cursors;
   size_t activeIndex;
-  Highlighter highlighter;
+  Highlighter *highlighter = nullptr;
   Provider provider;
   FontAtlas *atlas = nullptr;
   GLFWwindow *window;
@@ -59,6 +61,25 @@ public:
   int round = 0;
   int fontSize;
   Vim *vim;
+  // identifier under the cursor, looked up once the cursor rested
+  int64_t occurrenceWord = -1;
+  size_t occurrenceCount = 0;
+  bool occurrencePending = false;
+  double cursorMovedAt = 0;
+  Cursor *occurrenceCursor = nullptr;
+  int occurrenceX = -1;
+  int occurrenceY = -1;
+  uint64_t occurrenceRevision = 0;
+  static constexpr double OCCURRENCE_DELAY = 0.3;
+  // wheel scrolling eases the view towards scrollTarget, in lines
+  float scrollTarget = 0;
+  bool scrolling = false;
+  // with wrapping, what is left of a trackpad movement below a whole line
+  float wrapScrollRemainder = 0;
+  double scrolledAt = 0;
+  Cursor *scrollCursor = nullptr;
+  static constexpr float SCROLL_LINES = 3;
+  static constexpr float SCROLL_SPEED = 18;
   State() {}
 
   void invalidateCache() { cacheValid = false; }
@@ -81,7 +102,7 @@ public:
   void tryComment() {
     if (!hasHighlighting)
       return;
-    cursor->comment(highlighter.language.singleLineComment);
+    cursor->comment(highlighter->language->singleLineComment);
   }
   void registerVim() {
     this->vim = new Vim(this);
@@ -229,10 +250,7 @@ public:
       cursor->appendWithLines(str, vim != nullptr);
       if (mode != 0)
         return;
-      if (hasHighlighting)
-        highlighter.highlight(cursor->lines, &provider.colors, cursor->skip,
-                              cursor->maxLines, cursor->y,
-                              cursor->history.size());
+      cursor->updateHighlighter();
       status = U"Pasted " + numberToString(str.length()) + U" Characters";
     }
   }
@@ -377,10 +395,8 @@ public:
     status = U"cmd: [" + Utf8String(cmd) + U"]: executing";
   }
   void reHighlight() {
-    if (hasHighlighting)
-      highlighter.highlight(cursor->lines, &provider.colors, cursor->skip,
-                            cursor->maxLines, cursor->y,
-                            cursor->history.size());
+    // also keeps the bracket index of plain text buffers up to date
+    cursor->updateHighlighter();
   }
   void undo() {
     bool result = cursor->undo();
@@ -412,10 +428,8 @@ public:
                                     ? name.substr(name.find_last_of(".") + 1)
                                     : name);
     if (lang) {
-      highlighter.setLanguage(*lang, lang->modeName);
-      highlighter.highlight(cursor->lines, &provider.colors, cursor->skip,
-                            cursor->maxLines, cursor->y,
-                            cursor->history.size());
+      highlighter->setLanguage(*lang, lang->modeName);
+      cursor->updateHighlighter();
       hasHighlighting = true;
     }
   }
@@ -428,10 +442,8 @@ public:
         name.generic_string(),
         extension_str.length() ? extension_str.substr(1) : "");
     if (lang) {
-      highlighter.setLanguage(*lang, lang->modeName);
-      highlighter.highlight(cursor->lines, &provider.colors, cursor->skip,
-                            cursor->maxLines, cursor->y,
-                            cursor->history.size());
+      highlighter->setLanguage(*lang, lang->modeName);
+      cursor->updateHighlighter();
       hasHighlighting = true;
     } else {
       hasHighlighting = false;
@@ -522,7 +534,7 @@ public:
           hasHighlighting = false;
         } else {
           auto lang = getAllLanguages()[round - 1];
-          highlighter.setLanguage(*lang, lang->modeName);
+          highlighter->setLanguage(*lang, lang->modeName);
           hasHighlighting = true;
           status = U"Mode: " + miniBuf;
         }
@@ -630,9 +642,97 @@ public:
                            : cursors[round]->path);
     }
   }
+  void trackCursorRest() {
+    uint64_t revision = (size_t)cursor->y < cursor->lines.size()
+                            ? cursor->lines[cursor->y].getRevision()
+                            : 0;
+    if (cursor == occurrenceCursor && cursor->x == occurrenceX &&
+        cursor->y == occurrenceY && revision == occurrenceRevision)
+      return;
+    occurrenceCursor = cursor;
+    occurrenceX = cursor->x;
+    occurrenceY = cursor->y;
+    occurrenceRevision = revision;
+    occurrenceWord = -1;
+    occurrencePending = true;
+    cursorMovedAt = glfwGetTime();
+  }
+  void updateOccurrences() {
+    occurrencePending = false;
+    if (!hasHighlighting || cursor->bind != nullptr)
+      return;
+    cursor->updateHighlighter();
+    occurrenceWord = highlighter->wordAt(cursor->x, cursor->y);
+    if (occurrenceWord == -1)
+      return;
+    occurrenceCount = highlighter->wordCount(occurrenceWord);
+    renderCoords();
+    invalidateCache();
+  }
+  // lines is positive towards the end of the buffer
+  void scrollBy(float lines) {
+    if (lineWrapping) {
+      // wrapped rows have no fixed height, so the view moves by whole lines
+      wrapScrollRemainder += lines;
+      float whole = std::trunc(wrapScrollRemainder);
+      wrapScrollRemainder -= whole;
+      if (whole != 0)
+        cursor->scrollTo(cursor->skip + whole);
+      invalidateCache();
+      return;
+    }
+    if (!scrolling || scrollCursor != cursor) {
+      scrollTarget = cursor->skip + cursor->scroll;
+      scrolledAt = glfwGetTime();
+    }
+    float last = std::max(0, (int)cursor->lines.size() - cursor->maxLines);
+    scrollTarget = std::clamp(scrollTarget + lines, 0.0f, last);
+    scrollCursor = cursor;
+    scrolling = true;
+    invalidateCache();
+  }
+  // moves the view a frame closer to scrollTarget
+  void stepScroll() {
+    if (!scrolling)
+      return;
+    if (scrollCursor != cursor) {
+      scrolling = false;
+      return;
+    }
+    double now = glfwGetTime();
+    float position = cursor->skip + cursor->scroll;
+    float t = 1 - exp(-(now - scrolledAt) * SCROLL_SPEED);
+    scrolledAt = now;
+    position += (scrollTarget - position) * t;
+    if (fabs(scrollTarget - position) < 0.01) {
+      position = scrollTarget;
+      scrolling = false;
+    }
+    cursor->scrollTo(position);
+  }
+  // blocks until input arrives or a pending occurrence lookup is due
+  void waitForEvents() {
+    if (scrolling) {
+      glfwPollEvents();
+      return;
+    }
+    if (!occurrencePending) {
+      glfwWaitEvents();
+      return;
+    }
+    double remaining = cursorMovedAt + OCCURRENCE_DELAY - glfwGetTime();
+    if (remaining > 0) {
+      glfwWaitEventsTimeout(remaining);
+      if (glfwGetTime() < cursorMovedAt + OCCURRENCE_DELAY)
+        return;
+    }
+    if (occurrencePending)
+      updateOccurrences();
+  }
   void renderCoords() {
     if (mode != 0)
       return;
+    trackCursorRest();
     // if(hasHighlighting)
     // highlighter.highlight(cursor->lines, &provider.colors, cursor->skip,
     // cursor->maxLines, cursor->y);
@@ -647,10 +747,12 @@ public:
     status = (vim ? Utf8String(vim->getModeName()) + U" " : U"") +
              numberToString(cursor->y + 1) + U":" + numberToString(x) + branch +
              U" [" + fileName + U": " +
-             (hasHighlighting ? highlighter.languageName : U"Text") + U"]";
+             (hasHighlighting ? highlighter->languageName : U"Text") + U"]";
     if (cursor->selection.active)
       status +=
           U" Selected: [" + numberToString(cursor->getSelectionSize()) + U"]";
+    if (occurrenceWord != -1)
+      status += U" Occurrences: [" + numberToString(occurrenceCount) + U"]";
     if (vim && vim->getCount() > 0) {
       status += U" " + Utf8String(std::to_string(vim->getCount()));
     }
@@ -687,6 +789,11 @@ public:
   }
   void toggleLineWrapping() {
     lineWrapping = !lineWrapping;
+    // a scroll in progress ends on the whole line it was heading to
+    if (scrolling && scrollCursor == cursor)
+      cursor->scrollTo(std::round(scrollTarget));
+    scrolling = false;
+    wrapScrollRemainder = 0;
     status = U"(Experimental) Linewrapping: ";
     status += (lineWrapping ? U"true" : U"false");
   }
@@ -711,6 +818,8 @@ public:
     activeIndex = cursorIndex;
     std::string path = entry->path;
     this->cursor = &(entry->cursor);
+    this->highlighter = &(entry->highlighter);
+    entry->cursor.highlighter = this->highlighter;
     if (vim)
       vim->setCursor(this->cursor);
     this->path = path;
@@ -758,7 +867,7 @@ public:
     if (path.length()) {
       newCursor.branch = provider.getBranchName(path);
     }
-    CursorEntry *entry = new CursorEntry{newCursor, path};
+    CursorEntry *entry = new CursorEntry{newCursor, path, Highlighter()};
     cursors.push_back(entry);
     activateCursor(cursors.size() - 1);
   }
@@ -773,92 +882,7 @@ public:
   }
   void init() {
     glGenVertexArrays(1, &vao);
-    glGenBuffers(1, &vbo);
-    glBindVertexArray(vao);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    // TODO set size of vbo base on buffer size?
-
-    glBufferData(GL_ARRAY_BUFFER, sizeof(RenderChar) * 600 * 1000, nullptr,
-                 GL_DYNAMIC_DRAW);
-    activate_entries();
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
-
-    // //selection buffer;
-    glGenVertexArrays(1, &sel_vao);
-    glGenBuffers(1, &sel_vbo);
-    glBindVertexArray(sel_vao);
-    glBindBuffer(GL_ARRAY_BUFFER, sel_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(SelectionEntry) * 16, nullptr,
-                 GL_DYNAMIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(SelectionEntry),
-                          (void *)offsetof(SelectionEntry, pos));
-    glVertexAttribDivisor(0, 1);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(SelectionEntry),
-                          (void *)offsetof(SelectionEntry, size));
-    glVertexAttribDivisor(1, 1);
-
-    // //selection buffer;
-    glGenVertexArrays(1, &highlight_vao);
-    glGenBuffers(1, &highlight_vbo);
-    glBindVertexArray(highlight_vao);
-    glBindBuffer(GL_ARRAY_BUFFER, highlight_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(SelectionEntry), nullptr,
-                 GL_DYNAMIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(SelectionEntry),
-                          (void *)offsetof(SelectionEntry, pos));
-    glVertexAttribDivisor(0, 1);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(SelectionEntry),
-                          (void *)offsetof(SelectionEntry, size));
-    glVertexAttribDivisor(1, 1);
-
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
-  }
-
-private:
-  void activate_entries() {
-    // pos
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(RenderChar),
-                          (void *)offsetof(RenderChar, pos));
-    glVertexAttribDivisor(0, 1);
-
-    // size
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(RenderChar),
-                          (void *)offsetof(RenderChar, size));
-    glVertexAttribDivisor(1, 1);
-
-    // uv_pos
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(RenderChar),
-                          (void *)offsetof(RenderChar, uv_pos));
-    glVertexAttribDivisor(2, 1);
-    // uv_size
-    glEnableVertexAttribArray(3);
-    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(RenderChar),
-                          (void *)offsetof(RenderChar, uv_size));
-    glVertexAttribDivisor(3, 1);
-    // fg_color
-    glEnableVertexAttribArray(4);
-    glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(RenderChar),
-                          (void *)offsetof(RenderChar, fg_color));
-    glVertexAttribDivisor(4, 1);
-    // bg_color
-    glEnableVertexAttribArray(5);
-    glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(RenderChar),
-                          (void *)offsetof(RenderChar, bg_color));
-    glVertexAttribDivisor(5, 1);
-
-    glEnableVertexAttribArray(6);
-    glVertexAttribPointer(6, 1, GL_FLOAT, GL_FALSE, sizeof(RenderChar),
-                          (void *)offsetof(RenderChar, hasColor));
-    glVertexAttribDivisor(6, 1);
+    instances.init();
   }
 };
 
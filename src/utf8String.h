@@ -5,6 +5,8 @@
 #else
 #include <cstddef>
 #endif
+#include <algorithm>
+#include <atomic>
 #include <string>
 #include <vector>
 class Utf8String {
@@ -99,16 +101,19 @@ public:
   Utf8String(Utf8String &other) {
     this->base = other.base;
     setState();
+    revision = other.revision;
   }
   Utf8String(const Utf8String &other) {
     this->base = other.base;
     setState();
+    revision = other.revision;
   }
 
   Utf8String(const size_t len, const char32_t *ptr) {
     std::vector<char32_t> buff(ptr, ptr + len);
     base = unicodeToUtf8(buff);
     character_length = len;
+    touch();
   }
 
   Utf8String(const size_t len, const char32_t in) {
@@ -116,18 +121,21 @@ public:
     buff.push_back(in);
     base = unicodeToUtf8(buff);
     character_length = len;
+    touch();
   }
 
   Utf8String(const char32_t input[]) {
     std::u32string str(input);
     this->character_length = str.length();
     this->base = unicodeToUtf8(str);
+    touch();
   }
 
   Utf8String &operator+=(const char32_t input[]) {
     std::u32string str(input);
     this->character_length += str.length();
     this->base += unicodeToUtf8(str);
+    touch();
     return *this;
   }
 
@@ -135,6 +143,7 @@ public:
     std::u32string str(input);
     this->character_length = str.length();
     this->base = unicodeToUtf8(str);
+    touch();
     return *this;
   }
 
@@ -223,6 +232,11 @@ public:
   char32_t operator[](int i) { return getCharacterAt(i); }
 
   size_t length() const { return this->character_length; }
+  /*
+    Changes whenever the content changes, copies keep the revision of their
+    source so equal revisions always mean equal content.
+  */
+  uint64_t getRevision() const { return this->revision; }
   size_t size() const { return this->character_length; }
   std::string getStr() const { return this->base; }
   const std::string &getStrRef() const { return this->base; }
@@ -234,9 +248,66 @@ public:
     return this->toCodePoints(this->base, off, len);
   }
 
+  // adds the codepoints of columns from to to to out, without a copy
+  void appendCodePoints(std::vector<char32_t> &out, size_t from,
+                        size_t to) const {
+    if (to <= from)
+      return;
+    auto p = calculateByteLength(from, to - from);
+    decode(base.data() + p.first, p.second, out);
+  }
+  // offset of the first byte of codepoint index, only scans up to it
+  size_t byteOffset(size_t index) const {
+    if (base.length() == character_length)
+      return std::min(index, base.length());
+    size_t offset = 0;
+    for (; offset < base.length(); offset++) {
+      if (((uint8_t)base[offset] & 0xc0) != 0x80 && index-- == 0)
+        break;
+    }
+    return offset;
+  }
+  /*
+    Adds up to count codepoints of the l bytes at u to out and returns the
+    bytes they took, stops at the first invalid sequence.
+  */
+  static size_t decode(const char *u, size_t l, std::vector<char32_t> &out,
+                       size_t count = (size_t)-1) {
+    size_t used = 0;
+    while (l > 0 && count > 0) {
+      uint8_t u0 = u[0];
+      size_t n;
+      if (u0 <= 127) {
+        out.push_back(u0);
+        n = 1;
+      } else if (u0 >= 192 && u0 <= 223 && l >= 2) {
+        out.push_back((u0 - 192) * 64 + ((uint8_t)u[1] - 128));
+        n = 2;
+      } else if (u0 >= 224 && u0 <= 239 && l >= 3) {
+        if (u0 == 0xed && (u[1] & 0xa0) == 0xa0)
+          break;
+        out.push_back((u0 - 224) * 4096 + ((uint8_t)u[1] - 128) * 64 +
+                      ((uint8_t)u[2] - 128));
+        n = 3;
+      } else if (u0 >= 240 && u0 <= 247 && l >= 4) {
+        out.push_back((u0 - 240) * 262144 + ((uint8_t)u[1] - 128) * 4096 +
+                      ((uint8_t)u[2] - 128) * 64 + ((uint8_t)u[3] - 128));
+        n = 4;
+      } else {
+        break;
+      }
+      u += n;
+      l -= n;
+      used += n;
+      count--;
+    }
+    return used;
+  }
   char32_t getCharacterAt(size_t index) const {
     if (character_length == 0)
       return 0;
+    if (index < character_length && base.length() == character_length)
+      return (unsigned char)base[index];
     auto p = calculateByteLength(index, 1);
     std::string sub = this->base.substr(p.first, p.second);
     std::vector<char32_t> entries = toCodePoints(sub);
@@ -260,6 +331,7 @@ public:
   void append(const Utf8String &other) {
     this->base += other.base;
     this->character_length += other.character_length;
+    touch();
   }
   void append(char32_t cp) {
     std::vector<char32_t> cps = {cp};
@@ -269,17 +341,20 @@ public:
     std::string value = unicodeToUtf8(cps);
     character_length += cps.size();
     this->base += value;
+    touch();
   }
   void appendAt(Utf8String &other, size_t start) {
     auto p = this->calculateByteLength(start);
     this->base.insert(p.first, other.base);
     this->character_length += other.character_length;
+    touch();
   }
   void appendAt(std::vector<char32_t> &cps, size_t start) {
     auto p = this->calculateByteLength(start);
     std::string value = unicodeToUtf8(cps);
     character_length += cps.size();
     this->base.insert(p.first, value);
+    touch();
   }
   void appendAt(char32_t cp, size_t start) {
     std::vector<char32_t> cps = {cp};
@@ -300,7 +375,7 @@ public:
     auto p = calculateByteLength(idx, 1);
     this->base.erase(p.first, p.second);
     this->base.insert(p.first, temp.getStrRef());
-
+    touch();
   }
 private:
   std::string unicodeToUtf8(std::vector<char32_t> &in) {
@@ -370,6 +445,11 @@ private:
     if (character_start == 0 && length == character_length) {
       return std::pair(0, base.length());
     }
+    // only ascii, every codepoint is one byte
+    if (base.length() == character_length) {
+      size_t start = std::min(character_start, character_length);
+      return std::pair(start, std::min(length, character_length - start));
+    }
     const std::string &u = this->base;
     int l = u.length();
     size_t offset = 0;
@@ -481,6 +561,11 @@ private:
 
   void setState() {
     this->character_length = calculateCharacterLength(this->base);
+    touch();
+  }
+  void touch() {
+    static std::atomic<uint64_t> counter{1};
+    revision = counter.fetch_add(1, std::memory_order_relaxed);
   }
   std::vector<char32_t> toCodePoints(const std::string &u, size_t off = 0,
                                      size_t len = 0) const {
@@ -538,6 +623,7 @@ private:
   }
   std::string base;
   size_t character_length = 0;
+  uint64_t revision = 0;
   size_t idx;
 };
 
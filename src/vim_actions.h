@@ -515,10 +515,9 @@ public:
       if (state.action.length() == 1) {
         for (auto &pair : PAIRS) {
           if (state.action[0] == pair.first || state.action[0] == pair.second) {
-            Utf8String in(state.action);
             bool isClosing = state.action[0] == pair.second;
-            auto result =
-                cursor->findGlobal(!isClosing, in, cursor->x, cursor->y);
+            auto result = cursor->findPairBoundary(pair, isClosing, cursor->x,
+                                                   cursor->y);
             if (result.first == -1 && result.second == -1) {
               return {};
             }
@@ -631,6 +630,7 @@ public:
         if (!co) {
 
           str.erase(cursor->x, length);
+          cursor->markEdited(cursor->y, cursor->y + 1);
           cursor->historyPush(3, w.length(), w);
         }
       } else if (state.direction == Direction::UP) {
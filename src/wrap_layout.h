@@ -0,0 +1,166 @@
+#ifndef WRAP_LAYOUT_H
+#define WRAP_LAYOUT_H
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "font_atlas.h"
+#include "utf8String.h"
+
+/*
+  Where wrapped lines break into rows. The columns starting a new row are
+  found on the prefix advances of a line and kept per line revision until
+  the width, the scale or the glyphs change. The rows of the lines from the
+  top of the view are summed up as they're asked for, so going from a line
+  to its row and back is a binary search.
+*/
+class WrapLayout {
+public:
+  static const size_t MAX_LINES = 4096;
+  // lines counted from the first line of a view before it starts over
+  static constexpr size_t MAX_VIEW = 1024;
+  // width is how far a row may reach before the next glyph goes below
+  void configure(FontAtlas &atlas, float width) {
+    this->atlas = &atlas;
+    if (width == this->width && atlas.scale == scale &&
+        atlas.layoutVersion == layoutVersion)
+      return;
+    this->width = width;
+    scale = atlas.scale;
+    layoutVersion = atlas.layoutVersion;
+    breakCache.clear();
+    starts.assign(1, 0);
+    revisions.clear();
+  }
+  /*
+    Columns starting a new row. A row wraps after the first glyph that
+    starts past the width, so every row has at least one glyph.
+  */
+  const std::vector<uint32_t> &breaks(const Utf8String &line) {
+    auto found = breakCache.find(line.getRevision());
+    if (found != breakCache.end())
+      return found->second;
+    if (breakCache.size() >= MAX_LINES)
+      breakCache.clear();
+    std::vector<uint32_t> out;
+    auto &advances = atlas->getLineAdvances(line);
+    size_t length = advances.length();
+    float limit = scale > 0 ? width / scale : 0;
+    size_t start = 0;
+    while (start < length) {
+      size_t last = std::min(
+          advances.columnPast(advances.at(start) + limit, start), length);
+      if (last + 1 >= length)
+        break;
+      start = last + 1;
+      out.push_back(start);
+    }
+    return breakCache[line.getRevision()] = std::move(out);
+  }
+  // keeps the breaks handed out from now on for count more lines
+  void reserve(size_t count) {
+    if (breakCache.size() + count > MAX_LINES)
+      breakCache.clear();
+  }
+  int rows(const Utf8String &line) { return breaks(line).size() + 1; }
+  // rows are counted from first on, again after lines changed
+  void beginView(const std::vector<Utf8String> &lines, size_t first) {
+    view = &lines;
+    this->first = first;
+    starts.assign(1, 0);
+    revisions.clear();
+  }
+  /*
+    Whether the view is of lines and the rows counted so far still hold
+    for them, with line not above it or far below. Edited, inserted or
+    removed lines show as a different revision where one was counted.
+  */
+  bool viewing(const std::vector<Utf8String> &lines, size_t line) const {
+    if (view != &lines || line < first || line > first + revisions.size() ||
+        revisions.size() > MAX_VIEW || first + revisions.size() > lines.size())
+      return false;
+    for (size_t i = 0; i < revisions.size(); i++) {
+      if (lines[first + i].getRevision() != revisions[i])
+        return false;
+    }
+    return true;
+  }
+  // counts the rows up to line, the view starts over at it if it's above
+  void extendTo(size_t line) {
+    if (view->empty())
+      return;
+    if (line < first)
+      beginView(*view, line);
+    line = std::min(line, view->size() - 1);
+    while (first + starts.size() - 1 < line)
+      extend();
+  }
+  // row of column in line, relative to the first line of the view
+  int rowOf(size_t line, size_t column) {
+    if (view->empty())
+      return 0;
+    extendTo(line);
+    size_t index = std::min(line, view->size() - 1) - first;
+    auto &lineBreaks = breaks((*view)[first + index]);
+    return starts[index] +
+           (std::upper_bound(lineBreaks.begin(), lineBreaks.end(), column) -
+            lineBreaks.begin());
+  }
+  // first column of the row containing column
+  size_t rowStart(const Utf8String &line, size_t column) {
+    auto &lineBreaks = breaks(line);
+    auto it = std::upper_bound(lineBreaks.begin(), lineBreaks.end(), column);
+    return it == lineBreaks.begin() ? 0 : *(it - 1);
+  }
+  /*
+    Line and column range of a row of the view, rows past the end give the
+    last row of the last line.
+  */
+  struct Row {
+    size_t line = 0;
+    size_t begin = 0;
+    size_t end = 0;
+  };
+  Row at(int row) {
+    row = std::max(row, 0);
+    while (starts.back() <= row && first + starts.size() - 1 < view->size())
+      extend();
+    size_t index =
+        std::upper_bound(starts.begin(), starts.end(), row) - starts.begin();
+    index = std::min(index, starts.size() - 1);
+    if (index == 0 || first + index - 1 >= view->size())
+      return {};
+    index--;
+    Row out;
+    out.line = first + index;
+    auto &line = (*view)[out.line];
+    auto &lineBreaks = breaks(line);
+    size_t inLine =
+        std::min((size_t)(row - starts[index]), lineBreaks.size());
+    out.begin = inLine > 0 ? lineBreaks[inLine - 1] : 0;
+    out.end = inLine < lineBreaks.size() ? lineBreaks[inLine] : line.length();
+    return out;
+  }
+
+private:
+  FontAtlas *atlas = nullptr;
+  float width = -1;
+  float scale = 0;
+  uint64_t layoutVersion = 0;
+  std::unordered_map<uint64_t, std::vector<uint32_t>> breakCache;
+  const std::vector<Utf8String> *view = nullptr;
+  size_t first = 0;
+  // starts[i] is the row line first + i begins at
+  std::vector<int> starts;
+  // revision of each line counted into starts
+  std::vector<uint64_t> revisions;
+
+  void extend() {
+    auto &line = (*view)[first + starts.size() - 1];
+    revisions.push_back(line.getRevision());
+    starts.push_back(starts.back() + rows(line));
+  }
+};
+
+#endif